@@ -14,6 +14,8 @@ local pending_metadata_write = { key = nil, name = nil }
 local DEVICE_MAPPINGS = {
     connected = {
         ["Audio/Sink"] = {
+            pal_sink_speaker    = "pal_sink_headset",
+            pal_sink_headset    = "pal_sink_headset",
             pal_sink_speaker_ll = "pal_sink_headset_ll",
             pal_sink_speaker_db = "pal_sink_headset_db",
             pal_sink_headset_ll = "pal_sink_headset_ll",
@@ -26,6 +28,8 @@ local DEVICE_MAPPINGS = {
     },
     disconnected = {
         ["Audio/Sink"] = {
+            pal_sink_headset    = "pal_sink_speaker",
+            pal_sink_speaker    = "pal_sink_speaker",
             pal_sink_headset_ll = "pal_sink_speaker_ll",
             pal_sink_headset_db = "pal_sink_speaker_db",
             pal_sink_speaker_ll = "pal_sink_speaker_ll",
@@ -232,6 +236,8 @@ local function register_jack_hook()
                         (is_sink and "sink" or "source") ..
                         ": " .. tostring(current_default))
 
+            -- Only configs with separate _ll/_db sinks need flavor matching,
+            -- pal.latency-switch sinks have no suffix and never mismatch.
             if is_sink then
                 local cur_ll  = current_default and current_default:find("_ll") ~= nil
                 local cur_db  = current_default and current_default:find("_db") ~= nil
@@ -2,6 +2,10 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -13,17 +17,36 @@
 #include <signal.h>
 #include <limits.h>
 #include <math.h>
+#include <inttypes.h>
 #include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/input.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 #include <spa/utils/result.h>
 #include <spa/utils/string.h>
 #include <spa/utils/json.h>
+#include <spa/utils/dict.h>
+#include <spa/utils/atomic.h>
 #include <spa/utils/ringbuffer.h>
 #include <spa/debug/types.h>
+#include <spa/node/node.h>
+#include <spa/node/io.h>
+#include <spa/node/utils.h>
+#include <spa/pod/filter.h>
 #include <spa/pod/builder.h>
+#include <spa/pod/parser.h>
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/audio/raw.h>
 #include <spa/param/buffers.h>
+#include <spa/param/props.h>
+#include <spa/param/latency-utils.h>
 #include <pipewire/impl.h>
 #include <pipewire/i18n.h>
 #include <PalApi.h>
@@ -41,6 +64,14 @@
 PW_LOG_TOPIC_STATIC(log_topic, "log:" LOG_TAG);
 #define PW_LOG_TOPIC_DEFAULT log_topic
 
+/* USDT probes in provider pw_pal, a single nop each when not traced. The
+ * first argument is always the graph node id. See tools/pw-pal-trace.py. */
+#ifdef HAVE_SYS_SDT_H
+#define PW_PAL_TRACE(name, ...) STAP_PROBEV(pw_pal, name, ##__VA_ARGS__)
+#else
+#define PW_PAL_TRACE(name, ...) do { } while (0)
+#endif
+
 #define PW_DEFAULT_SAMPLE_FORMAT "S16"
 #define PW_DEFAULT_SAMPLE_RATE 48000
 #define PW_DEFAULT_SAMPLE_CHANNELS 2
@@ -48,10 +79,460 @@ PW_LOG_TOPIC_STATIC(log_topic, "log:" LOG_TAG);
 #define PW_DEFAULT_BUFFER_DURATION_MS 25
 #define PW_LOW_LATENCY_BUFFER_DURATION_MS 5
 #define PW_DEEP_BUFFER_BUFFER_DURATION_MS 20
+#define PW_VOIP_BUFFER_DURATION_MS 20
+#define PW_GRAPH_DEFAULT_QUANTUM 1024
 #define MAX_NAME_LENGTH 20
 #define DEV_INPUT_DIR "/dev/input"
 #define FILE_PREFIX "event"
 #define MAX_DEVICES 4
+#define PW_DEFAULT_STATS_INTERVAL_MS 0
+#define PW_STATS_RUSAGE_INTERVAL_NS SPA_NSEC_PER_SEC
+#define PW_MAX_STATS 32
+#define PW_DEFAULT_DRAIN_TIMEOUT_MS 5000
+#define PW_DEFAULT_FRAGMENT_SIZE (256 * 1024)
+#define PW_DEFAULT_FRAGMENT_COUNT 2
+#define PW_MAX_FRAGMENT_SIZE (8 * 1024 * 1024)
+#define PW_MAX_FRAGMENTS 8
+#define PW_DEFAULT_LL_QUANTUM_LIMIT 512
+#define PW_LATENCY_SWITCH_HOLD_CYCLES 16
+#define PW_DEFAULT_SILENCE_PREROLL_MS 10
+#define PW_NODE_MAX_BUFFERS 32
+#define PW_DEFAULT_SSR_RETRY_MS 500
+#define PW_PAL_BUFFER_ALIGN 64
+/* graph buffers are mapped, shared or plain memory both work */
+#define PW_PAL_BUFFER_TYPES ((1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr))
+#define PW_PAL_MAX_TAPS 4
+#define PW_PAL_FANOUT_PERIODS 16
+
+/* Scheduling requested for the thread that runs this node's process
+ * callback, i.e. the data loop thread that also performs the PAL I/O. Only
+ * used for nodes on a named loop, all nodes on that loop should ask for the
+ * same. */
+struct pw_pal_thread_sched {
+    cpu_set_t cpu_set;
+    bool has_affinity;
+    int rt_priority;
+    bool applied;
+    pthread_t thread;
+};
+
+enum pw_pal_offload_state {
+    PW_PAL_OFFLOAD_RUNNING,
+    PW_PAL_OFFLOAD_PARTIAL_DRAIN,   /* waiting for PAL to reach the track boundary */
+    PW_PAL_OFFLOAD_NEXT_TRACK,      /* boundary reached, next track metadata pending */
+    PW_PAL_OFFLOAD_DRAIN,           /* full drain of the queued data in progress */
+    PW_PAL_OFFLOAD_DRAINED,
+};
+
+/* Power mode for compress offload: graph buffers are staged into large
+ * fragments allocated once at load time, and PAL is only fed whole
+ * fragments. Once PAL and the pool are both full the stream is made
+ * inactive, so the graph stops scheduling the node, until the DSP asks
+ * for more data.
+ * Fragments form a ring: [head, head + n_full) are ready for PAL, the
+ * fragment at head + n_full is being filled from the graph. */
+struct pw_pal_fragment_pool {
+    uint8_t *mem;
+    uint32_t size;
+    uint32_t count;
+    uint32_t head;
+    uint32_t n_full;
+    uint32_t fill;
+    uint32_t write_offset;
+    uint32_t len[PW_MAX_FRAGMENTS];
+};
+
+/* Compress offload playback keeps its PAL session across track changes
+ * and pauses; track boundaries are signalled to the DSP with a partial
+ * drain and the gapless metadata of the next track. */
+struct pw_pal_offload {
+    int state;
+    bool next_track;
+    /* end of stream, drain once the staged tail is in PAL */
+    bool drain;
+    bool paused;
+    /* gapless metadata of the next track as delay << 32 | padding, so the
+     * data thread never picks up half of an update */
+    uint64_t next_gapless;
+
+    /* graph buffer that PAL only partially accepted */
+    struct pw_buffer *pending;
+    uint32_t pending_offset;
+
+    uint32_t drain_timeout_ms;
+    struct spa_source *drain_event;
+    struct spa_source *drain_timer;
+    /* close_pal_stream() waits on these for WRITE_READY and DRAIN_READY */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    uint64_t transitions;
+    uint64_t partial_drain_start_ns;
+    uint64_t transition_ns;
+
+    struct pw_pal_fragment_pool pool;
+    /* power mode: set by the data thread when nothing more fits, cleared
+     * on WRITE_READY; the main thread makes the stream follow it */
+    int idle;
+    bool inactive;
+    struct spa_source *idle_event;
+    /* DSP requests for more data (WRITE_READY); together with the graph
+     * process cycles these are the CPU wakeups of the node */
+    uint64_t wakeups;
+    uint64_t last_write_ns;
+    uint64_t max_write_gap_ns;
+};
+
+/* Counted by the TX process callback. */
+struct pw_pal_duplex_stats {
+    uint64_t cycles;
+    uint64_t cycle_ns_total;
+    uint64_t cycle_ns_max;
+    uint64_t pal_ns_total;
+    /* cycles that produced silence because nothing was read from PAL */
+    uint64_t silent_cycles;
+    /* frames written to RX minus frames read from TX, relative to the
+     * first cycle after start; stays constant while aligned */
+    int64_t frame_skew;
+    int64_t frame_skew_max;
+};
+
+/* Capture half of a VoIP duplex node. The playback (RX) half is the
+ * module's main stream; both PAL sessions are opened and started as one
+ * unit and both graph nodes share a node.group so they run in the same
+ * cycle, which keeps the DSP echo reference at a fixed offset. */
+struct pw_pal_duplex {
+    struct pw_properties *props;
+    struct pw_stream *stream;
+    struct spa_hook stream_listener;
+
+    /* published once started, pinned by the TX process callback */
+    pal_stream_handle_t *handle;
+    int users;
+    struct pal_stream_attributes attributes;
+    struct pal_device device;
+    size_t buf_size;
+    size_t buf_count;
+    uint32_t node_id;
+
+    int sync;
+    uint64_t rx_frames;
+    uint64_t rx_base;
+    uint64_t tx_frames;
+
+    struct pw_pal_duplex_stats stats;
+    uint32_t stats_seq;
+    struct pw_pal_duplex_stats stats_copy;
+};
+
+/* DSP-only loopback from an input to an output device, e.g. sidetone.
+ * The graph node only carries the Props used to enable it and set the
+ * gain, no audio goes through PipeWire. */
+struct pw_pal_loopback {
+    bool enabled;
+    float gain;
+    /* time to open and start the session, not the audio latency */
+    uint64_t start_ns;
+};
+
+enum pw_pal_latency_stage {
+    PW_PAL_LATENCY_IDLE,
+    PW_PAL_LATENCY_REQUESTED,
+    PW_PAL_LATENCY_PENDING,
+    PW_PAL_LATENCY_SWAPPED,
+};
+
+/* PCM playback node that picks a low-latency or deep-buffer PAL session
+ * from the graph quantum. The data thread asks for a switch, the main
+ * thread opens the new session and the data thread moves its writes to it
+ * between two writes. The old session keeps playing what it queued: the
+ * main thread stops it when that ran out and starts the new one, which
+ * holds the audio written meanwhile, so the two never play at the same
+ * time and nothing queued is cut. Only the main thread changes
+ * stream_handle; the data thread writes to next while pinned in users. */
+struct pw_pal_latency_switch {
+    bool enabled;
+    uint32_t quantum_limit;
+    struct spa_io_position *position;
+
+    int stage;
+    bool failed;
+    pal_stream_type_t current;
+    pal_stream_type_t requested;
+    uint32_t wanted_cycles;
+    size_t ll_buf_size;
+    size_t db_buf_size;
+    pal_stream_handle_t *next;
+    int users;
+    /* bytes queued into next before it is started, up to its buffers */
+    size_t held;
+    /* end of the last write to the old session, its buffers full */
+    uint64_t last_write_ns;
+    struct spa_source *event;
+    struct spa_source *playout_timer;
+
+    uint64_t switches;
+    uint64_t switch_start_ns;
+    uint64_t switch_ns;
+    uint64_t dropped;
+};
+
+enum pw_pal_silence_state {
+    PW_PAL_SILENCE_ACTIVE,
+    PW_PAL_SILENCE_STANDBY_REQUESTED,
+    PW_PAL_SILENCE_STANDBY,
+    PW_PAL_SILENCE_RESUME_REQUESTED,
+    PW_PAL_SILENCE_RESUMED,
+};
+
+/* PCM playback that only receives zeros stops feeding PAL after hold_ns
+ * and the main thread stops the session. From the first non-zero buffer on
+ * the audio is held in the pre-roll buffer, behind preroll_lead bytes of
+ * silence, until the session runs again. It then replaces the cycle's
+ * write, with the live buffer behind it, to the session that write would
+ * have gone to. The restarted session's empty PAL buffers take it without
+ * blocking: preroll_size is what they hold and up to preroll_hold of it is
+ * used while waiting, leaving one PAL buffer free for the live buffer. */
+struct pw_pal_silence {
+    uint64_t hold_ns;
+    uint64_t silent_ns;
+    int state;
+    struct spa_source *event;
+
+    uint8_t *preroll;
+    uint32_t preroll_size;
+    uint32_t preroll_hold;
+    uint32_t preroll_lead;
+    uint32_t preroll_fill;
+
+    /* main thread */
+    bool stopped;
+    uint64_t standby_start_ns;
+    uint64_t idle_ns;
+    uint64_t standbys;
+    /* data thread */
+    uint64_t writes_skipped;
+    /* audio that arrived with the pre-roll full, before the resume */
+    uint64_t dropped;
+};
+
+enum pw_pal_prime_state {
+    PW_PAL_PRIME_IDLE,
+    PW_PAL_PRIME_OPENING,
+    PW_PAL_PRIME_OPENED,
+    PW_PAL_PRIME_READY,
+    PW_PAL_PRIME_RUNNING,
+};
+
+/* PCM playback with pal.start.preroll-periods holds the graph's first
+ * buffers on the data thread while the main thread opens and sizes the
+ * session. Once they cover that many PAL periods they are written to the
+ * session before it is started, so the DSP starts on a full queue. What
+ * arrived on top of that goes out ahead of the live buffers over the next
+ * cycles, at most one PAL period more per write, so no write waits for
+ * more than one period to free up. */
+struct pw_pal_prime {
+    uint32_t periods;
+    int state;
+    struct spa_source *event;
+
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t fill;
+    /* main thread, before the start */
+    uint32_t period;
+    uint32_t target;
+    uint32_t limit;
+    /* written to PAL, by the main thread and then the data thread */
+    uint32_t handed;
+
+    /* main thread */
+    uint64_t start_ns;
+    uint64_t open_ns;
+    uint64_t primed_bytes;
+    /* armed by the main thread when nothing was primed */
+    int first_write;
+    uint64_t first_sound_ns;
+    /* data thread */
+    uint64_t dropped;
+};
+
+/* Combined sinks render to every device of their devices list that is
+ * present. Devices behind the node's jack come and go with it and the PAL
+ * session is rerouted in place. */
+struct pw_pal_combined {
+    bool enabled;
+    uint32_t n_devices;
+    pal_device_id_t devices[MAX_DEVICES];
+    uint32_t present;
+    uint64_t reroutes;
+};
+
+/* Path latency of a device beyond the PAL buffers, pal.device.latency-us */
+struct pw_pal_device_latency {
+    pal_device_id_t id;
+    uint32_t us;
+};
+
+/* Scratch memory the data thread works in (compress fragments, silence and
+ * start pre-roll, capture ring) is carved from one page aligned block that is faulted in and
+ * locked at load time. */
+struct pw_pal_arena {
+    uint8_t *mem;
+    size_t size;
+    bool locked;
+};
+
+/* One consumer of a shared capture session: the module's own source node
+ * or one of the extra pal.capture.taps nodes. */
+struct pw_pal_tap {
+    struct pw_userdata *udata;
+    struct pw_properties *props;
+    struct pw_stream *stream;
+    struct spa_hook stream_listener;
+    uint32_t node_id;
+
+    /* set by the main thread, the consumer restarts at the write position */
+    int sync;
+    /* main thread: the stream failed and is destroyed from reap_event */
+    bool failed;
+    /* data thread of this consumer */
+    uint64_t read_pos;
+    uint64_t lag;
+    uint64_t lag_max;
+    uint64_t overruns;
+    uint64_t underruns;
+};
+
+/* pal.capture.taps: several source nodes, each with its own node.latency,
+ * read from one PAL capture session. Whichever consumer runs short claims
+ * the next period by moving fill_pos and reads it from PAL into a ring,
+ * without a lock; the others copy from the ring at their own pace and,
+ * like a seqlock reader, check fill_pos afterwards to see whether what
+ * they copied was overwritten. */
+struct pw_pal_fanout {
+    bool enabled;
+    uint8_t *ring;
+    uint32_t size;
+    uint32_t period;
+    uint64_t write_pos;
+    /* write_pos, or one period ahead while a consumer reads from PAL */
+    uint64_t fill_pos;
+    /* the started session as seen by the consumers, see pw_pal_handle_pin() */
+    pal_stream_handle_t *handle;
+    int users;
+    struct spa_source *reap_event;
+
+    uint32_t n_taps;
+    uint32_t active;
+    struct pw_pal_tap taps[PW_PAL_MAX_TAPS + 1];
+};
+
+enum {
+    PW_PAL_SSR_ONLINE,
+    PW_PAL_SSR_OFFLINE,
+    PW_PAL_SSR_DISCARD,
+    PW_PAL_SSR_CLOSED,
+};
+
+/* A DSP subsystem restart invalidates every PAL session. The data thread
+ * stops touching the handles and acknowledges with DISCARD, the main thread
+ * then closes them and reopens the sessions once the sound card is back,
+ * using the node's current device, volume and buffer configuration. */
+struct pw_pal_ssr {
+    struct spa_list link;
+    int state;
+    int card_offline;
+    struct spa_source *event;
+    struct spa_source *retry_timer;
+    uint32_t retry_ms;
+#ifdef PW_PAL_FAULT_INJECTION
+    /* pal.ssr.fault-after: report every Nth PAL transfer as a restart */
+    uint32_t fault_after;
+#endif
+    /* set by whoever reports the restart first */
+    uint64_t offline_ns;
+
+    /* main thread */
+    bool retrying;
+    uint64_t recovery_ns;
+    uint64_t recoveries;
+    /* data thread */
+#ifdef PW_PAL_FAULT_INJECTION
+    uint64_t transfers;
+#endif
+    uint64_t dropped;
+};
+
+enum {
+    PW_PAL_PORT_EnumFormat,
+    PW_PAL_PORT_IO,
+    PW_PAL_PORT_Format,
+    PW_PAL_PORT_Buffers,
+    PW_PAL_PORT_Latency,
+    PW_PAL_PORT_N_PARAMS,
+};
+
+enum {
+    PW_PAL_NODE_ProcessLatency,
+    PW_PAL_NODE_N_PARAMS,
+};
+
+/* Native spa_node implementation of the PCM sink/source, selected with
+ * pal.node.mode = "spa". The graph calls process() with the negotiated
+ * buffers directly, without a pw_stream and its adapter in between. Inside
+ * the daemon the node is registered in its context, in a client such as
+ * pw-cli it is exported to the daemon through proxy. The node always
+ * follows a driver: it has no clock of its own that tracks the DSP. */
+struct pw_pal_node {
+    struct spa_node node;
+    struct spa_hook_list hooks;
+    struct spa_callbacks callbacks;
+    struct pw_impl_node *impl;
+    struct spa_hook impl_listener;
+    struct pw_proxy *proxy;
+    struct spa_hook proxy_listener;
+
+    enum spa_direction direction;
+    struct spa_node_info info;
+    struct spa_param_info params[PW_PAL_NODE_N_PARAMS];
+    struct spa_port_info port_info;
+    struct spa_param_info port_params[PW_PAL_PORT_N_PARAMS];
+
+    struct spa_io_buffers *io;
+    struct spa_io_position *position;
+
+    bool have_format;
+    struct spa_audio_info_raw format;
+    struct spa_buffer *buffers[PW_NODE_MAX_BUFFERS];
+    uint32_t n_buffers;
+    uint32_t locked_mask;
+    /* output buffers not handed to the graph */
+    uint32_t free_mask;
+
+    bool started;
+};
+
+/* Counters updated from the data thread. A copy taken at the end of every
+ * cycle is published as pal.stats.* node properties from the main loop. */
+struct pw_pal_stats {
+    uint64_t cycles;
+    uint64_t cycle_ns_total;
+    uint64_t cycle_ns_max;
+    /* time spent inside PAL read/write calls and from the driver wakeup
+     * to the start of the cycle; the rest of a cycle is plugin overhead */
+    uint64_t pal_ns_total;
+    uint64_t wakeup_ns_total;
+    uint64_t wakeup_ns_max;
+    /* length of the first cycle after the session started */
+    uint64_t first_cycle_ns;
+    int32_t thread_id;
+    int32_t cpu;
+    uint64_t migrations;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+    uint64_t last_rusage_ns;
+};
 
 struct pw_userdata {
     struct pw_context *context;
@@ -69,6 +550,8 @@ struct pw_userdata {
     struct pw_properties *stream_props;
     struct pw_stream *stream;
     struct spa_hook stream_listener;
+    bool use_node;
+    struct pw_pal_node node;
     struct spa_audio_info_raw info;
     uint32_t frame_size;
     struct spa_audio_info format;
@@ -76,23 +559,182 @@ struct pw_userdata {
     unsigned int do_disconnect:1;
 
     pal_stream_handle_t *stream_handle;
-    struct pal_device *pal_device;
-    struct pal_stream_attributes *stream_attributes;
+    /* PAL descriptors are owned by the node and reused across open/close
+     * cycles, so starting/stopping the stream never touches the heap. */
+    struct pal_device pal_device[MAX_DEVICES];
+    struct pal_stream_attributes stream_attributes;
+    union {
+        struct pal_volume_data data;
+        uint8_t storage[sizeof(struct pal_volume_data) +
+            sizeof(struct pal_channel_vol_kv) * SPA_AUDIO_MAX_CHANNELS];
+    } volume;
     bool isplayback;
+    uint32_t node_id;
     pal_stream_type_t stream_type;
     pal_device_id_t pal_device_id[MAX_DEVICES];
     uint32_t no_of_devices;
+    struct pw_pal_combined combined;
+    struct pw_pal_device_latency device_latency[MAX_DEVICES];
+    uint32_t n_device_latency;
+    uint64_t latency_ns;
     bool is_offload;
     size_t source_buf_size;
     size_t source_buf_count;
     size_t sink_buf_size;
     size_t sink_buf_count;
+    struct pw_pal_offload offload;
+    bool is_duplex;
+    struct pw_pal_duplex tx;
+    bool is_loopback;
+    struct pw_pal_loopback loopback;
+    struct pw_pal_latency_switch latency;
+    struct pw_pal_silence silence;
+    struct pw_pal_prime prime;
+    struct pw_pal_ssr ssr;
+    struct pw_pal_fanout fanout;
 
     struct spa_source *jack_src;
     int jack_fd;
     char jack_name[MAX_NAME_LENGTH];
+
+    struct pw_pal_arena arena;
+    uint64_t locked_bytes;
+    bool lock_failed;
+
+    struct pw_pal_thread_sched sched;
+    struct pw_pal_stats stats;
+    /* odd while the data thread updates stats_copy */
+    uint32_t stats_seq;
+    struct pw_pal_stats stats_copy;
+    /* armed by the main thread when a session starts */
+    int first_cycle;
+    uint64_t last_publish_ns;
+    uint64_t last_wakeups;
+    struct spa_source *stats_timer;
+    uint32_t stats_interval_ms;
 };
 
+static inline uint64_t pw_pal_get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+/* Any thread: lock memory the data thread is going to touch, mlock() also
+ * faults it in. The memory may be a read-only or shared graph buffer, so it
+ * is not written. A missing RLIMIT_MEMLOCK only costs the locking. */
+static bool pw_pal_lock_memory(struct pw_userdata *udata, void *mem, size_t size)
+{
+    if (mlock(mem, size) < 0) {
+        if (SPA_ATOMIC_CAS(udata->lock_failed, false, true))
+            pw_log_warn("can't lock %zu bytes of audio memory: %m", size);
+        return false;
+    }
+    __atomic_fetch_add(&udata->locked_bytes, size, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+static void pw_pal_unlock_memory(struct pw_userdata *udata, void *mem, size_t size)
+{
+    munlock(mem, size);
+    __atomic_fetch_sub(&udata->locked_bytes, size, __ATOMIC_SEQ_CST);
+}
+
+static void pw_pal_arena_deinit(struct pw_userdata *udata)
+{
+    struct pw_pal_arena *arena = &udata->arena;
+
+    if (arena->locked)
+        pw_pal_unlock_memory(udata, arena->mem, arena->size);
+    free(arena->mem);
+    arena->mem = NULL;
+    udata->offload.pool.mem = NULL;
+    udata->silence.preroll = NULL;
+    udata->prime.buf = NULL;
+    udata->fanout.ring = NULL;
+}
+
+/* Main thread: a new session starts, every consumer picks up from its
+ * first period. */
+static void pw_pal_fanout_sync(struct pw_userdata *udata)
+{
+    uint32_t i;
+
+    for (i = 0; i < udata->fanout.n_taps; i++)
+        SPA_ATOMIC_STORE(udata->fanout.taps[i].sync, 1);
+}
+
+/* PAL has a single global callback per process, shared by all instances. */
+static struct spa_list pw_pal_ssr_nodes = SPA_LIST_INIT(&pw_pal_ssr_nodes);
+static pthread_mutex_t pw_pal_ssr_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool pw_pal_ssr_registered;
+
+/* Any thread: the DSP went down, the first one to notice reports it. */
+static void pw_pal_ssr_offline(struct pw_userdata *udata, int next)
+{
+    struct pw_pal_ssr *ssr = &udata->ssr;
+
+    if (!SPA_ATOMIC_CAS(ssr->state, PW_PAL_SSR_ONLINE, next))
+        return;
+    ssr->offline_ns = pw_pal_get_time_ns();
+    pw_log_warn("%s: DSP is offline, discarding audio",
+            pw_properties_get(udata->stream_props, PW_KEY_NODE_NAME));
+    pw_loop_signal_event(pw_context_get_main_loop(udata->context), ssr->event);
+}
+
+/* Data thread: true while the sessions must not be touched. */
+static inline bool pw_pal_ssr_discard(struct pw_userdata *udata)
+{
+    struct pw_pal_ssr *ssr = &udata->ssr;
+    int state = SPA_ATOMIC_LOAD(ssr->state);
+
+    if (state == PW_PAL_SSR_ONLINE)
+        return false;
+    /* let the main thread know the handles are no longer in use */
+    if (state == PW_PAL_SSR_OFFLINE &&
+        SPA_ATOMIC_CAS(ssr->state, PW_PAL_SSR_OFFLINE, PW_PAL_SSR_DISCARD))
+        pw_loop_signal_event(pw_context_get_main_loop(udata->context), ssr->event);
+    ssr->dropped++;
+    return true;
+}
+
+/* Data thread: PAL reports a restart as -ENETRESET on the transfer. */
+static inline int pw_pal_ssr_check(struct pw_userdata *udata, int rc)
+{
+#ifdef PW_PAL_FAULT_INJECTION
+    struct pw_pal_ssr *ssr = &udata->ssr;
+
+    if (ssr->fault_after && ++ssr->transfers % ssr->fault_after == 0)
+        rc = -ENETRESET;
+#endif
+    if (rc == -ENETRESET)
+        pw_pal_ssr_offline(udata, PW_PAL_SSR_DISCARD);
+    return rc;
+}
+
+static void pw_pal_ssr_deinit(struct pw_userdata *udata)
+{
+    struct pw_pal_ssr *ssr = &udata->ssr;
+
+    if (ssr->link.next) {
+        pthread_mutex_lock(&pw_pal_ssr_lock);
+        spa_list_remove(&ssr->link);
+        /* don't leave PAL calling into an unloaded module */
+        if (spa_list_is_empty(&pw_pal_ssr_nodes) && pw_pal_ssr_registered) {
+            pal_register_global_callback(NULL, 0);
+            pw_pal_ssr_registered = false;
+        }
+        pthread_mutex_unlock(&pw_pal_ssr_lock);
+        ssr->link.next = NULL;
+    }
+    if (ssr->event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), ssr->event);
+    if (ssr->retry_timer)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), ssr->retry_timer);
+}
+
 static void pw_pal_destroy_stream(void *d)
 {
     struct pw_userdata *udata = d;
@@ -101,57 +743,546 @@ static void pw_pal_destroy_stream(void *d)
     udata->stream = NULL;
 }
 
+/* Applies the metadata set for the next track. */
+static int pw_pal_offload_set_gapless(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct pal_compr_gapless_mdata mdata;
+    /* called from the main and the data thread, each builds its own copy */
+    union {
+        pal_param_payload data;
+        uint8_t storage[sizeof(pal_param_payload) + sizeof(struct pal_compr_gapless_mdata)];
+    } param;
+    uint64_t gapless = SPA_ATOMIC_LOAD(offload->next_gapless);
+    int rc;
+
+    mdata.encoderDelay = gapless >> 32;
+    mdata.encoderPadding = gapless & UINT32_MAX;
+    param.data.payload_size = sizeof(mdata);
+    memcpy(param.data.payload, &mdata, sizeof(mdata));
+
+    rc = pal_stream_set_param(udata->stream_handle, PAL_PARAM_ID_GAPLESS_MDATA, &param.data);
+    if (rc)
+        pw_log_error("could not set gapless metadata delay:%u padding:%u, error %d",
+                mdata.encoderDelay, mdata.encoderPadding, rc);
+    return rc;
+}
+
+/* Main thread: the session drained or was flushed, make it accept data
+ * again. */
+static void pw_pal_offload_restart(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+
+    pw_loop_update_timer(pw_context_get_main_loop(udata->context), offload->drain_timer,
+            NULL, NULL, false);
+    pal_stream_stop(udata->stream_handle);
+    if (pal_stream_start(udata->stream_handle))
+        pw_log_error("could not restart compress stream %p", udata->stream_handle);
+    SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_RUNNING);
+}
+
+/* Main thread, signalled when the data thread issued a full drain and
+ * again on DRAIN_READY. Once drained the session is restarted, if the
+ * graph already resumed, so it accepts the next stream. */
+static void pw_pal_offload_drain_done(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_offload *offload = &udata->offload;
+    struct timespec timeout;
+
+    if (udata->stream == NULL || udata->stream_handle == NULL || offload->paused)
+        return;
+
+    switch (SPA_ATOMIC_LOAD(offload->state)) {
+    case PW_PAL_OFFLOAD_DRAIN:
+        timeout.tv_sec = offload->drain_timeout_ms / SPA_MSEC_PER_SEC;
+        timeout.tv_nsec = (offload->drain_timeout_ms % SPA_MSEC_PER_SEC) * SPA_NSEC_PER_MSEC;
+        pw_loop_update_timer(pw_context_get_main_loop(udata->context), offload->drain_timer,
+                &timeout, NULL, false);
+        break;
+    case PW_PAL_OFFLOAD_DRAINED:
+        if (pw_stream_get_state(udata->stream, NULL) == PW_STREAM_STATE_STREAMING)
+            pw_pal_offload_restart(udata);
+        break;
+    default:
+        break;
+    }
+}
+
+static void pw_pal_offload_drain_timeout(void *data, uint64_t expirations)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_offload *offload = &udata->offload;
+
+    if (udata->stream_handle == NULL || offload->paused ||
+        SPA_ATOMIC_LOAD(offload->state) != PW_PAL_OFFLOAD_DRAIN)
+        return;
+
+    pw_log_error("drain of %p timed out, discarding queued data", udata->stream_handle);
+    SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_DRAINED);
+    pw_pal_offload_drain_done(udata, 0);
+}
+
+/* Main thread, graph paused: halt the DSP where it is. The session, the
+ * data queued in it and the staged fragments are kept for the resume. */
+static void pw_pal_offload_pause(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    int rc;
+
+    if (udata->stream_handle == NULL || offload->paused)
+        return;
+
+    pw_loop_update_timer(pw_context_get_main_loop(udata->context), offload->drain_timer,
+            NULL, NULL, false);
+    offload->paused = true;
+    if ((rc = pal_stream_pause(udata->stream_handle)) == 0)
+        return;
+
+    /* a DSP that can not pause must not keep playing, flush it instead */
+    pw_log_error("pal_stream_pause failed for %p error %d, stopping it",
+            udata->stream_handle, rc);
+    pal_stream_stop(udata->stream_handle);
+}
+
+static void pw_pal_offload_resume(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+
+    if (offload->paused) {
+        offload->paused = false;
+        if (pal_stream_resume(udata->stream_handle)) {
+            pw_pal_offload_restart(udata);
+            return;
+        }
+    }
+    /* re-arm the drain timeout or finish a drain completed while paused */
+    pw_pal_offload_drain_done(udata, 0);
+}
+
+/* Main thread: stop or restart graph scheduling of a power mode stream. */
+static void pw_pal_offload_idle_event(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_offload *offload = &udata->offload;
+    bool idle = SPA_ATOMIC_LOAD(offload->idle);
+
+    if (udata->stream == NULL || idle == offload->inactive)
+        return;
+    offload->inactive = idle;
+    pw_stream_set_active(udata->stream, !idle);
+}
+
+/* Main thread: let the data thread run again, e.g. for a drain request. */
+static void pw_pal_offload_wake(struct pw_userdata *udata)
+{
+    SPA_ATOMIC_STORE(udata->offload.idle, 0);
+    pw_pal_offload_idle_event(udata, 0);
+}
+
 static int32_t pa_pal_out_cb(pal_stream_handle_t *stream_handle,
                             uint32_t event_id, uint32_t *event_data,
                             uint32_t event_size, uint64_t cookie) {
+    struct pw_userdata *udata = (struct pw_userdata *)cookie;
+    struct pw_pal_offload *offload;
+
+    if (udata == NULL || !udata->is_offload)
+        return 0;
 
+    offload = &udata->offload;
+    switch (event_id) {
+    case PAL_STREAM_CBK_EVENT_WRITE_READY:
+        pthread_mutex_lock(&offload->lock);
+        SPA_ATOMIC_INC(offload->wakeups);
+        pthread_cond_signal(&offload->cond);
+        pthread_mutex_unlock(&offload->lock);
+        if (SPA_ATOMIC_CAS(offload->idle, 1, 0))
+            pw_loop_signal_event(pw_context_get_main_loop(udata->context),
+                    offload->idle_event);
+        break;
+    case PAL_STREAM_CBK_EVENT_PARTIAL_DRAIN_READY:
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_NEXT_TRACK);
+        break;
+    case PAL_STREAM_CBK_EVENT_DRAIN_READY:
+        pthread_mutex_lock(&offload->lock);
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_DRAINED);
+        pthread_cond_signal(&offload->cond);
+        pthread_mutex_unlock(&offload->lock);
+        pw_loop_signal_event(pw_context_get_main_loop(udata->context),
+                offload->drain_event);
+        break;
+    case PAL_STREAM_CBK_EVENT_ERROR:
+        pw_log_error("compress stream %p reported an error", stream_handle);
+        break;
+    default:
+        break;
+    }
     return 0;
 }
-static void pw_pal_set_volume (struct pw_userdata *udata, float gain)
+static void pw_pal_set_volume (struct pw_userdata *udata, pal_stream_handle_t *handle, float gain)
 {
     int rc = 0, i;
     uint32_t channel_mask = 1;
-    uint32_t no_vol_pair = udata->stream_attributes->out_media_config.ch_info.channels;
-    struct pal_volume_data *volume = (struct pal_volume_data *)malloc(sizeof(uint32_t) +
-        (sizeof(struct pal_channel_vol_kv) * (no_vol_pair)));
+    uint32_t no_vol_pair = SPA_MIN(udata->stream_attributes.out_media_config.ch_info.channels,
+        SPA_AUDIO_MAX_CHANNELS);
+    struct pal_volume_data *volume = &udata->volume.data;
+
     for (i = 0; i < no_vol_pair; i++)
-        channel_mask = (channel_mask | udata->stream_attributes->out_media_config.ch_info.ch_map[i]);
+        channel_mask = (channel_mask | udata->stream_attributes.out_media_config.ch_info.ch_map[i]);
     channel_mask = (channel_mask << 1);
-    if (volume) {
-        volume->no_of_volpair = no_vol_pair;
-        for (i = 0; i < no_vol_pair; i++) {
-            volume->volume_pair[i].channel_mask = channel_mask;
-            volume->volume_pair[i].vol = gain;
+
+    volume->no_of_volpair = no_vol_pair;
+    for (i = 0; i < no_vol_pair; i++) {
+        volume->volume_pair[i].channel_mask = channel_mask;
+        volume->volume_pair[i].vol = gain;
+    }
+    rc = pal_stream_set_volume(handle, volume);
+    if (rc)
+        pw_log_error("pal_stream_set_volume failed for %p error %d", handle, rc);
+}
+static void pw_pal_offload_account_write(struct pw_pal_offload *offload)
+{
+    uint64_t now = pw_pal_get_time_ns();
+
+    if (offload->last_write_ns && now - offload->last_write_ns >
+            SPA_ATOMIC_LOAD(offload->max_write_gap_ns))
+        SPA_ATOMIC_STORE(offload->max_write_gap_ns, now - offload->last_write_ns);
+    offload->last_write_ns = now;
+}
+
+/* Closes the fragment being filled so it gets written even if short. */
+static void pw_pal_pool_commit(struct pw_pal_fragment_pool *pool)
+{
+    if (pool->fill == 0 || pool->n_full == pool->count)
+        return;
+    pool->len[(pool->head + pool->n_full) % pool->count] = pool->fill;
+    pool->n_full++;
+    pool->fill = 0;
+}
+
+/* Feeds ready fragments to PAL until it stops accepting data. Returns
+ * true when all ready fragments were consumed. */
+static bool pw_pal_pool_write(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct pw_pal_fragment_pool *pool = &offload->pool;
+    struct pal_buffer pal_buf;
+    uint32_t len;
+    ssize_t rc;
+
+    while (pool->n_full > 0) {
+        len = pool->len[pool->head];
+        if (pool->write_offset >= len)
+            goto next;
+
+        memset(&pal_buf, 0, sizeof(struct pal_buffer));
+        pal_buf.buffer = pool->mem + (size_t)pool->head * pool->size + pool->write_offset;
+        pal_buf.size = len - pool->write_offset;
+
+        pw_pal_offload_account_write(offload);
+        PW_PAL_TRACE(write_entry, udata->node_id, pal_buf.size);
+        rc = pal_stream_write(udata->stream_handle, &pal_buf);
+        PW_PAL_TRACE(write_exit, udata->node_id, pal_buf.size, rc);
+        rc = pw_pal_ssr_check(udata, rc);
+        if (rc < 0) {
+            pw_log_error("Could not write fragment: %zd %d", rc, __LINE__);
+            rc = pal_buf.size;
+        }
+        pool->write_offset += rc;
+        if (pool->write_offset < len)
+            return false;
+next:
+        pool->head = (pool->head + 1) % pool->count;
+        pool->n_full--;
+        pool->write_offset = 0;
+    }
+    return true;
+}
+
+static pal_stream_type_t pw_pal_latency_wanted(struct pw_userdata *udata)
+{
+    struct pw_pal_latency_switch *ls = &udata->latency;
+
+    if (ls->position == NULL || ls->position->clock.duration == 0)
+        return ls->current;
+    return ls->position->clock.duration <= ls->quantum_limit ?
+        PAL_STREAM_LOW_LATENCY : PAL_STREAM_DEEP_BUFFER;
+}
+
+static inline size_t pw_pal_latency_buf_size(struct pw_userdata *udata, pal_stream_type_t type)
+{
+    return type == PAL_STREAM_LOW_LATENCY ? udata->latency.ll_buf_size : udata->latency.db_buf_size;
+}
+
+/* PAL handles that the main thread opens and closes while a data thread
+ * transfers on them. The data thread pins the handle for one transfer.
+ * The main thread unpublishes it and waits for transfers in flight, at
+ * most one period, before closing it. */
+static pal_stream_handle_t *pw_pal_handle_pin(pal_stream_handle_t **handle, int *users)
+{
+    pal_stream_handle_t *h;
+
+    SPA_ATOMIC_INC(*users);
+    if ((h = SPA_ATOMIC_LOAD(*handle)) == NULL)
+        SPA_ATOMIC_DEC(*users);
+    return h;
+}
+
+static inline void pw_pal_handle_unpin(int *users)
+{
+    SPA_ATOMIC_DEC(*users);
+}
+
+static pal_stream_handle_t *pw_pal_handle_unpublish(pal_stream_handle_t **handle, int *users)
+{
+    pal_stream_handle_t *h = *handle;
+
+    SPA_ATOMIC_STORE(*handle, NULL);
+    while (SPA_ATOMIC_LOAD(*users))
+        sched_yield();
+    return h;
+}
+
+static void pw_pal_close_handle(struct pw_userdata *udata, pal_stream_handle_t *handle)
+{
+    int rc;
+
+    if ((rc = pal_stream_stop(handle)))
+        pw_log_error("pal_stream_stop failed for %p error %d", handle, rc);
+    if ((rc = pal_stream_close(handle)))
+        pw_log_error("could not close sink handle %p, error %d", handle, rc);
+    PW_PAL_TRACE(close, udata->node_id, rc);
+}
+
+/* Main thread, graph stopped: drop a switch that is still in flight. */
+static void pw_pal_latency_reset(struct pw_userdata *udata)
+{
+    struct pw_pal_latency_switch *ls = &udata->latency;
+    int stage = SPA_ATOMIC_LOAD(ls->stage);
+    pal_stream_handle_t *next;
+
+    pw_loop_update_timer(pw_context_get_main_loop(udata->context), ls->playout_timer,
+            NULL, NULL, false);
+    next = pw_pal_handle_unpublish(&ls->next, &ls->users);
+    /* the next session was opened but not started yet */
+    if ((stage == PW_PAL_LATENCY_PENDING || stage == PW_PAL_LATENCY_SWAPPED) && next)
+        pal_stream_close(next);
+    ls->last_write_ns = 0;
+    ls->wanted_cycles = 0;
+    SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_IDLE);
+}
+
+/* Main thread, graph stopped: the session is about to be closed. */
+static void pw_pal_silence_reset(struct pw_userdata *udata)
+{
+    struct pw_pal_silence *silence = &udata->silence;
+
+    if (silence->stopped)
+        silence->idle_ns += pw_pal_get_time_ns() - silence->standby_start_ns;
+    silence->stopped = false;
+    silence->silent_ns = 0;
+    silence->preroll_fill = 0;
+    SPA_ATOMIC_STORE(silence->state, PW_PAL_SILENCE_ACTIVE);
+}
+
+/* Main thread: drop what was held for a start that did not happen. */
+static void pw_pal_prime_reset(struct pw_userdata *udata)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+
+    SPA_ATOMIC_STORE(prime->state, PW_PAL_PRIME_IDLE);
+    SPA_ATOMIC_STORE(prime->first_write, 0);
+    prime->fill = 0;
+    prime->handed = 0;
+}
+
+/* Main thread: wait for the next PAL callback, false past the deadline. */
+static bool pw_pal_offload_wait(struct pw_pal_offload *offload, uint64_t wakeups,
+        const struct timespec *deadline)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&offload->lock);
+    while (rc == 0 && SPA_ATOMIC_LOAD(offload->wakeups) == wakeups &&
+            SPA_ATOMIC_LOAD(offload->state) != PW_PAL_OFFLOAD_DRAINED)
+        rc = pthread_cond_timedwait(&offload->cond, &offload->lock, deadline);
+    pthread_mutex_unlock(&offload->lock);
+    return rc == 0;
+}
+
+/* Main thread, the graph no longer feeds the session: play out what is
+ * staged and queued before it is stopped, within compress.drain-timeout-ms.
+ * A paused session or a dead DSP has nothing to play out. */
+static void pw_pal_offload_drain_sync(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct timespec deadline;
+    uint64_t wakeups, ns;
+    int rc;
+
+    if (offload->paused || SPA_ATOMIC_LOAD(offload->state) == PW_PAL_OFFLOAD_DRAINED ||
+        SPA_ATOMIC_LOAD(udata->ssr.state) != PW_PAL_SSR_ONLINE)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    ns = SPA_TIMESPEC_TO_NSEC(&deadline) + offload->drain_timeout_ms * SPA_NSEC_PER_MSEC;
+    deadline.tv_sec = ns / SPA_NSEC_PER_SEC;
+    deadline.tv_nsec = ns % SPA_NSEC_PER_SEC;
+
+    if (SPA_ATOMIC_LOAD(offload->state) != PW_PAL_OFFLOAD_DRAIN) {
+        if (offload->pool.mem) {
+            pw_pal_pool_commit(&offload->pool);
+            do {
+                wakeups = SPA_ATOMIC_LOAD(offload->wakeups);
+                if (pw_pal_pool_write(udata))
+                    break;
+            } while (pw_pal_offload_wait(offload, wakeups, &deadline));
+        }
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_DRAIN);
+        if ((rc = pal_stream_drain(udata->stream_handle, PAL_DRAIN))) {
+            pw_log_error("pal_stream_drain failed for %p error %d", udata->stream_handle, rc);
+            return;
         }
-        rc = pal_stream_set_volume(udata->stream_handle, volume);
-        free(volume);
     }
+    do {
+        wakeups = SPA_ATOMIC_LOAD(offload->wakeups);
+    } while (SPA_ATOMIC_LOAD(offload->state) != PW_PAL_OFFLOAD_DRAINED &&
+            pw_pal_offload_wait(offload, wakeups, &deadline));
+
+    if (SPA_ATOMIC_LOAD(offload->state) != PW_PAL_OFFLOAD_DRAINED)
+        pw_log_warn("drain of %p timed out, discarding queued data", udata->stream_handle);
 }
+
 static int close_pal_stream(struct pw_userdata *udata)
 {
     int rc = -1;
 
+    if (udata->prime.periods)
+        pw_pal_prime_reset(udata);
+    if (udata->latency.enabled)
+        pw_pal_latency_reset(udata);
     if (udata->stream_handle) {
-        rc = pal_stream_stop(udata->stream_handle);
+        if (udata->fanout.enabled)
+            pw_pal_handle_unpublish(&udata->fanout.handle, &udata->fanout.users);
+        if (udata->is_offload)
+            pw_pal_offload_drain_sync(udata);
+        /* an idle session was already stopped */
+        if (udata->silence.stopped)
+            rc = 0;
+        else
+            rc = pal_stream_stop(udata->stream_handle);
         if (rc) {
             pw_log_error("pal_stream_stop failed for %p error %d", udata->stream_handle, rc);
         }
+        if (udata->silence.hold_ns)
+            pw_pal_silence_reset(udata);
         rc = pal_stream_close(udata->stream_handle);
         if (rc)
             pw_log_error("could not close sink handle %p, error %d", udata->stream_handle, rc);
+        PW_PAL_TRACE(close, udata->node_id, rc);
         udata->stream_handle = NULL;
+        udata->offload.state = PW_PAL_OFFLOAD_RUNNING;
+        udata->offload.drain = false;
+        udata->offload.paused = false;
+        if (udata->offload.inactive)
+            pw_pal_offload_wake(udata);
+        if (udata->offload.drain_timer)
+            pw_loop_update_timer(pw_context_get_main_loop(udata->context),
+                    udata->offload.drain_timer, NULL, NULL, false);
+        udata->offload.pool.head = 0;
+        udata->offload.pool.n_full = 0;
+        udata->offload.pool.fill = 0;
+        udata->offload.pool.write_offset = 0;
     }
     else
         return 0;
 
     return rc;
 }
+
+/* Main thread: hand what the graph delivered so far to the opened session,
+ * up to what its buffers hold so the write does not block. */
+static void pw_pal_prime_write(struct pw_userdata *udata)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+    struct pal_buffer pal_buf;
+    ssize_t rc;
+
+    prime->handed = SPA_MIN(SPA_ATOMIC_LOAD(prime->fill), prime->limit);
+    memset(&pal_buf, 0, sizeof(struct pal_buffer));
+    pal_buf.buffer = prime->buf;
+    pal_buf.size = prime->handed;
+    PW_PAL_TRACE(write_entry, udata->node_id, pal_buf.size);
+    rc = pal_stream_write(udata->stream_handle, &pal_buf);
+    PW_PAL_TRACE(write_exit, udata->node_id, pal_buf.size, rc);
+    if (rc < 0)
+        pw_log_error("could not prime session %p, error %zd", udata->stream_handle, rc);
+    else
+        prime->primed_bytes = rc;
+}
+
+/* Main thread: start an opened and sized session. */
+static void pw_pal_stream_run(struct pw_userdata *udata)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+    int rc;
+
+    if (prime->periods)
+        pw_pal_prime_write(udata);
+    rc = pal_stream_start(udata->stream_handle);
+    PW_PAL_TRACE(start, udata->node_id, rc);
+    if (rc) {
+        pw_log_error("pal_stream_start failed, error %d\n", rc);
+        if (close_pal_stream(udata))
+            pw_log_error("could not close sink handle %p", udata->stream_handle);
+        return;
+    }
+    SPA_ATOMIC_STORE(udata->first_cycle, 1);
+    if (udata->fanout.enabled)
+        SPA_ATOMIC_STORE(udata->fanout.handle, udata->stream_handle);
+    if (prime->periods) {
+        /* the queue holds graph data, it plays once pal_stream_start() returned */
+        prime->first_sound_ns = pw_pal_get_time_ns() - prime->start_ns;
+        SPA_ATOMIC_STORE(prime->state, PW_PAL_PRIME_RUNNING);
+    } else {
+        SPA_ATOMIC_STORE(prime->first_write, 1);
+    }
+    if (udata->is_loopback) {
+        udata->loopback.start_ns = pw_pal_get_time_ns() - prime->start_ns;
+        pw_pal_set_volume(udata, udata->stream_handle, udata->loopback.gain);
+    } else if (udata->isplayback) {
+        pw_log_error("pal_stream_start set volume, error %d\n", rc);
+        pw_pal_set_volume(udata, udata->stream_handle, 1.0);
+    }
+    if (udata->is_offload)
+        pw_pal_offload_set_gapless(udata);
+}
+
 static void pw_pal_stream_start(struct pw_userdata *udata)
 {
+    struct pw_pal_prime *prime = &udata->prime;
     int rc = 0;
     pal_buffer_config_t out_buf_cfg, in_buf_cfg;
-    rc = pal_stream_open(udata->stream_attributes, udata->no_of_devices, udata->pal_device,
+
+    prime->start_ns = pw_pal_get_time_ns();
+    if (prime->periods) {
+        /* the data thread holds the graph's buffers from now on */
+        prime->fill = 0;
+        prime->handed = 0;
+        SPA_ATOMIC_STORE(prime->state, PW_PAL_PRIME_OPENING);
+    }
+    if (udata->fanout.enabled)
+        pw_pal_fanout_sync(udata);
+    if (udata->latency.enabled) {
+        udata->latency.current = pw_pal_latency_wanted(udata);
+        udata->latency.failed = false;
+        udata->stream_attributes.type = udata->latency.current;
+    }
+
+    rc = pal_stream_open(&udata->stream_attributes, udata->no_of_devices, udata->pal_device,
          0, NULL, pa_pal_out_cb, (uint64_t)udata, &udata->stream_handle);
+    PW_PAL_TRACE(open, udata->node_id, udata->stream_attributes.type, rc);
 
     if (rc) {
         udata->stream_handle = NULL;
@@ -164,6 +1295,12 @@ static void pw_pal_stream_start(struct pw_userdata *udata)
         in_buf_cfg.buf_count = 0;
         out_buf_cfg.buf_size = udata->sink_buf_size;
         out_buf_cfg.buf_count = udata->sink_buf_count;
+        if (udata->offload.pool.mem) {
+            out_buf_cfg.buf_size = udata->offload.pool.size;
+            out_buf_cfg.buf_count = udata->offload.pool.count;
+        }
+        if (udata->latency.enabled)
+            out_buf_cfg.buf_size = pw_pal_latency_buf_size(udata, udata->latency.current);
     } else {
         out_buf_cfg.buf_size = 0;
         out_buf_cfg.buf_count = 0;
@@ -171,196 +1308,2398 @@ static void pw_pal_stream_start(struct pw_userdata *udata)
         in_buf_cfg.buf_count = udata->source_buf_count;
     }
 
-    rc = pal_stream_set_buffer_size(udata->stream_handle, &in_buf_cfg, &out_buf_cfg);
-    if(rc) {
-        pw_log_error("pal_stream_set_buffer_size failed\n");
-        goto exit;
+    /* a loopback session never exchanges buffers with the host */
+    if (!udata->is_loopback) {
+        rc = pal_stream_set_buffer_size(udata->stream_handle, &in_buf_cfg, &out_buf_cfg);
+        if(rc) {
+            pw_log_error("pal_stream_set_buffer_size failed\n");
+            goto exit;
+        }
     }
-    rc = pal_stream_start(udata->stream_handle);
+    prime->open_ns = pw_pal_get_time_ns() - prime->start_ns;
+
+    if (prime->periods) {
+        prime->period = out_buf_cfg.buf_size;
+        prime->target = prime->periods * out_buf_cfg.buf_size;
+        prime->limit = out_buf_cfg.buf_count * out_buf_cfg.buf_size;
+        SPA_ATOMIC_STORE(prime->state, PW_PAL_PRIME_OPENED);
+        /* otherwise pw_pal_prime_event() starts it once the graph caught up */
+        if (SPA_ATOMIC_LOAD(prime->fill) < prime->target ||
+            !SPA_ATOMIC_CAS(prime->state, PW_PAL_PRIME_OPENED, PW_PAL_PRIME_READY))
+            return;
+    }
+    pw_pal_stream_run(udata);
+    return;
+exit:
+    if (prime->periods)
+        SPA_ATOMIC_STORE(prime->state, PW_PAL_PRIME_IDLE);
+    return;
+
+}
+
+/* Main thread: the graph delivered the pre-roll for an opened session. */
+static void pw_pal_prime_event(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+
+    if (udata->stream_handle &&
+        SPA_ATOMIC_LOAD(udata->prime.state) == PW_PAL_PRIME_READY)
+        pw_pal_stream_run(udata);
+}
+/* Main thread: open a session of the requested type next to the running
+ * one. It is started once the running one stopped. */
+static int pw_pal_latency_open(struct pw_userdata *udata, pal_stream_type_t type,
+        pal_stream_handle_t **handle)
+{
+    pal_buffer_config_t out_buf_cfg, in_buf_cfg;
+    int rc;
+
+    udata->stream_attributes.type = type;
+    rc = pal_stream_open(&udata->stream_attributes, udata->no_of_devices, udata->pal_device,
+         0, NULL, pa_pal_out_cb, (uint64_t)udata, handle);
+    PW_PAL_TRACE(open, udata->node_id, type, rc);
     if (rc) {
-        pw_log_error("pal_stream_start failed, error %d\n", rc);
-        goto cleanup;
+        *handle = NULL;
+        pw_log_error("could not open %s session, error %d",
+                type == PAL_STREAM_LOW_LATENCY ? "low-latency" : "deep-buffer", rc);
+        return rc;
+    }
+
+    in_buf_cfg.buf_size = 0;
+    in_buf_cfg.buf_count = 0;
+    out_buf_cfg.buf_size = pw_pal_latency_buf_size(udata, type);
+    out_buf_cfg.buf_count = udata->sink_buf_count;
+    if ((rc = pal_stream_set_buffer_size(*handle, &in_buf_cfg, &out_buf_cfg)) == 0)
+        return 0;
+
+    pw_log_error("could not set up %s session, error %d",
+            type == PAL_STREAM_LOW_LATENCY ? "low-latency" : "deep-buffer", rc);
+    pal_stream_close(*handle);
+    *handle = NULL;
+    return rc;
+}
+
+/* Main thread, timer: the old session played what it queued. Stop it,
+ * then start the new one and make it the node's session. */
+static void pw_pal_latency_finish(void *data, uint64_t expirations)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_latency_switch *ls = &udata->latency;
+    pal_stream_handle_t *old = udata->stream_handle;
+    int rc;
+
+    if (SPA_ATOMIC_LOAD(ls->stage) != PW_PAL_LATENCY_SWAPPED)
+        return;
+
+    if ((rc = pal_stream_stop(old)))
+        pw_log_error("pal_stream_stop failed for %p error %d", old, rc);
+    rc = pal_stream_start(ls->next);
+    PW_PAL_TRACE(start, udata->node_id, rc);
+    if (rc) {
+        /* go back to the old session until the stream restarts */
+        pw_log_error("could not start %s session, error %d",
+                ls->requested == PAL_STREAM_LOW_LATENCY ? "low-latency" : "deep-buffer", rc);
+        pal_stream_close(pw_pal_handle_unpublish(&ls->next, &ls->users));
+        ls->failed = true;
+        if ((rc = pal_stream_start(old)))
+            pw_log_error("could not restart %p, error %d", old, rc);
+        SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_IDLE);
+        return;
+    }
+    if ((rc = pal_stream_close(old)))
+        pw_log_error("could not close sink handle %p, error %d", old, rc);
+    PW_PAL_TRACE(close, udata->node_id, rc);
+
+    pw_pal_set_volume(udata, ls->next, 1.0);
+    udata->stream_handle = ls->next;
+    udata->stream_type = ls->requested;
+    ls->current = ls->requested;
+    ls->switches++;
+    ls->switch_ns = pw_pal_get_time_ns() - ls->switch_start_ns;
+    pw_log_info("switched to %s session in %" PRIu64 " us",
+            ls->current == PAL_STREAM_LOW_LATENCY ? "low-latency" : "deep-buffer",
+            (uint64_t)(ls->switch_ns / SPA_NSEC_PER_USEC));
+    /* the data thread goes back to stream_handle after this, next stays
+     * valid for a write still in flight */
+    SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_IDLE);
+}
+
+/* Main thread: the data thread writes to the new session now. The old one
+ * is stopped once its buffers, full at its last write, played out. */
+static void pw_pal_latency_playout(struct pw_userdata *udata)
+{
+    struct pw_pal_latency_switch *ls = &udata->latency;
+    uint64_t queued = (uint64_t)pw_pal_latency_buf_size(udata, ls->current) *
+            udata->sink_buf_count;
+    uint64_t end_ns = ls->last_write_ns +
+            queued * SPA_NSEC_PER_SEC / ((uint64_t)udata->info.rate * udata->frame_size);
+    struct timespec value;
+
+    if (ls->last_write_ns == 0 || end_ns <= pw_pal_get_time_ns()) {
+        pw_pal_latency_finish(udata, 0);
+        return;
+    }
+    value.tv_sec = end_ns / SPA_NSEC_PER_SEC;
+    value.tv_nsec = end_ns % SPA_NSEC_PER_SEC;
+    pw_loop_update_timer(pw_context_get_main_loop(udata->context), ls->playout_timer,
+            &value, NULL, true);
+}
+
+/* Main thread, signalled by the data thread when it requested a switch
+ * or moved to the new session. */
+static void pw_pal_latency_event(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_latency_switch *ls = &udata->latency;
+    pal_stream_handle_t *next;
+
+    switch (SPA_ATOMIC_LOAD(ls->stage)) {
+    case PW_PAL_LATENCY_REQUESTED:
+        ls->switch_start_ns = pw_pal_get_time_ns();
+        if (pw_pal_latency_open(udata, ls->requested, &next)) {
+            /* stay on the current session until the stream restarts */
+            ls->failed = true;
+            SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_IDLE);
+            break;
         }
-    if (udata->isplayback) {
-        pw_log_error("pal_stream_start set volume, error %d\n", rc);
-        pw_pal_set_volume(udata, 1.0);
+        SPA_ATOMIC_STORE(ls->next, next);
+        SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_PENDING);
+        break;
+    case PW_PAL_LATENCY_SWAPPED:
+        pw_pal_latency_playout(udata);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Data thread, before each write: returns the session to write to. Moves
+ * to an opened session, or asks for one once the quantum settled on the
+ * other side of the limit. The new session comes back pinned, the caller
+ * unpins it after the write. */
+static pal_stream_handle_t *pw_pal_latency_cycle(struct pw_userdata *udata, uint32_t size,
+        bool *pinned)
+{
+    struct pw_pal_latency_switch *ls = &udata->latency;
+    struct pw_loop *loop = pw_context_get_main_loop(udata->context);
+    pal_stream_handle_t *handle;
+    pal_stream_type_t wanted;
+
+    switch (SPA_ATOMIC_LOAD(ls->stage)) {
+    case PW_PAL_LATENCY_PENDING:
+        ls->held = 0;
+        SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_SWAPPED);
+        pw_loop_signal_event(loop, ls->event);
+        /* fallthrough */
+    case PW_PAL_LATENCY_SWAPPED:
+        /* not started yet, queue only what its buffers hold so the
+         * write does not block */
+        if (ls->held + size > pw_pal_latency_buf_size(udata, ls->requested) *
+                udata->sink_buf_count) {
+            SPA_ATOMIC_STORE(ls->dropped, ls->dropped + size);
+            return NULL;
+        }
+        if ((handle = pw_pal_handle_pin(&ls->next, &ls->users)) == NULL)
+            return NULL;
+        ls->held += size;
+        *pinned = true;
+        return handle;
+    case PW_PAL_LATENCY_IDLE:
+        break;
+    default:
+        return udata->stream_handle;
+    }
+
+    if (ls->failed || udata->stream_handle == NULL)
+        return udata->stream_handle;
+    wanted = pw_pal_latency_wanted(udata);
+    if (wanted == ls->current) {
+        ls->wanted_cycles = 0;
+        return udata->stream_handle;
+    }
+    if (++ls->wanted_cycles < PW_LATENCY_SWITCH_HOLD_CYCLES)
+        return udata->stream_handle;
+
+    ls->wanted_cycles = 0;
+    ls->requested = wanted;
+    SPA_ATOMIC_STORE(ls->stage, PW_PAL_LATENCY_REQUESTED);
+    pw_loop_signal_event(loop, ls->event);
+    return udata->stream_handle;
+}
+
+typedef uint64_t pw_pal_vec_t __attribute__((vector_size(16)));
+
+/* True when the buffer holds only zero bytes. Scans 64 bytes per step in
+ * vector registers and stops at the first block with sound in it. */
+static bool pw_pal_is_silence(const void *data, uint32_t size)
+{
+    const uint8_t *p = data;
+    pw_pal_vec_t v0, v1, v2, v3;
+    uint32_t i;
+    uint8_t tail = 0;
+
+    for (i = 0; i + 64 <= size; i += 64) {
+        memcpy(&v0, p + i, sizeof(v0));
+        memcpy(&v1, p + i + 16, sizeof(v1));
+        memcpy(&v2, p + i + 32, sizeof(v2));
+        memcpy(&v3, p + i + 48, sizeof(v3));
+        v0 |= v1 | v2 | v3;
+        if (v0[0] | v0[1])
+            return false;
+    }
+    for (; i < size; i++)
+        tail |= p[i];
+    return tail == 0;
+}
+
+/* Main thread: stop the session on a standby request from the data thread
+ * and start it again once that sees sound. */
+static void pw_pal_silence_event(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_silence *silence = &udata->silence;
+    int rc;
+
+    if (udata->stream_handle == NULL)
+        return;
+
+    if (SPA_ATOMIC_LOAD(silence->state) == PW_PAL_SILENCE_STANDBY_REQUESTED &&
+        !silence->stopped) {
+        if ((rc = pal_stream_stop(udata->stream_handle))) {
+            pw_log_error("could not stop idle session %p, error %d", udata->stream_handle, rc);
+        } else {
+            silence->stopped = true;
+            silence->standby_start_ns = pw_pal_get_time_ns();
+            silence->standbys++;
+        }
+        SPA_ATOMIC_CAS(silence->state, PW_PAL_SILENCE_STANDBY_REQUESTED,
+                rc ? PW_PAL_SILENCE_ACTIVE : PW_PAL_SILENCE_STANDBY);
+    }
+    if (SPA_ATOMIC_LOAD(silence->state) == PW_PAL_SILENCE_RESUME_REQUESTED) {
+        if (silence->stopped) {
+            rc = pal_stream_start(udata->stream_handle);
+            PW_PAL_TRACE(start, udata->node_id, rc);
+            if (rc)
+                pw_log_error("could not resume idle session %p, error %d",
+                        udata->stream_handle, rc);
+            silence->stopped = false;
+            silence->idle_ns += pw_pal_get_time_ns() - silence->standby_start_ns;
+        }
+        SPA_ATOMIC_STORE(silence->state, PW_PAL_SILENCE_RESUMED);
+    }
+}
+
+/* Data thread: returns true when the buffer must not be written to PAL.
+ * Once the session runs again data and size are pointed at the pre-roll,
+ * with the live buffer behind it, for the cycle's one write. */
+static bool pw_pal_silence_skip(struct pw_userdata *udata, void **data, uint32_t *size)
+{
+    struct pw_pal_silence *silence = &udata->silence;
+    struct pw_loop *loop = pw_context_get_main_loop(udata->context);
+
+    switch (SPA_ATOMIC_LOAD(silence->state)) {
+    case PW_PAL_SILENCE_ACTIVE:
+        if (!pw_pal_is_silence(*data, *size)) {
+            silence->silent_ns = 0;
+            return false;
+        }
+        silence->silent_ns += (uint64_t)*size * SPA_NSEC_PER_SEC /
+            ((uint64_t)udata->frame_size * udata->info.rate);
+        if (silence->silent_ns < silence->hold_ns)
+            return false;
+        silence->silent_ns = 0;
+        SPA_ATOMIC_STORE(silence->state, PW_PAL_SILENCE_STANDBY_REQUESTED);
+        pw_loop_signal_event(loop, silence->event);
+        break;
+    case PW_PAL_SILENCE_STANDBY_REQUESTED:
+    case PW_PAL_SILENCE_STANDBY:
+        if (pw_pal_is_silence(*data, *size))
+            break;
+        /* a few ms of silence ahead of the held audio while the path ramps up */
+        memset(silence->preroll, 0, silence->preroll_lead);
+        silence->preroll_fill = silence->preroll_lead;
+        SPA_ATOMIC_STORE(silence->state, PW_PAL_SILENCE_RESUME_REQUESTED);
+        pw_loop_signal_event(loop, silence->event);
+        /* fallthrough */
+    case PW_PAL_SILENCE_RESUME_REQUESTED:
+        if (*size > silence->preroll_hold - silence->preroll_fill) {
+            /* the session is taking long to restart */
+            SPA_ATOMIC_STORE(silence->dropped, silence->dropped + *size);
+            return true;
+        }
+        memcpy(silence->preroll + silence->preroll_fill, *data, *size);
+        silence->preroll_fill += *size;
+        return true;
+    case PW_PAL_SILENCE_RESUMED:
+        SPA_ATOMIC_STORE(silence->state, PW_PAL_SILENCE_ACTIVE);
+        if (udata->stream_handle == NULL || silence->preroll_fill == 0) {
+            silence->preroll_fill = 0;
+            return false;
+        }
+        /* the held audio goes first; a live buffer larger than the free PAL
+         * buffer would make the write block, it is dropped instead */
+        if (*size <= silence->preroll_size - silence->preroll_fill) {
+            memcpy(silence->preroll + silence->preroll_fill, *data, *size);
+            silence->preroll_fill += *size;
+        } else {
+            SPA_ATOMIC_STORE(silence->dropped, silence->dropped + *size);
+        }
+        *data = silence->preroll;
+        *size = silence->preroll_fill;
+        /* not touched again before the state leaves ACTIVE */
+        silence->preroll_fill = 0;
+        return false;
+    default:
+        return false;
+    }
+    SPA_ATOMIC_INC(silence->writes_skipped);
+    return true;
+}
+
+static int pw_pal_duplex_open_tx(struct pw_userdata *udata, pal_stream_handle_t **handle)
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    pal_buffer_config_t out_buf_cfg, in_buf_cfg;
+    int rc;
+
+    rc = pal_stream_open(&tx->attributes, 1, &tx->device, 0, NULL, NULL, 0, handle);
+    PW_PAL_TRACE(open, tx->node_id, tx->attributes.type, rc);
+    if (rc) {
+        *handle = NULL;
+        pw_log_error("Could not open voip tx stream %d", rc);
+        return rc;
+    }
+
+    spa_zero(out_buf_cfg);
+    spa_zero(in_buf_cfg);
+    in_buf_cfg.buf_size = tx->buf_size;
+    in_buf_cfg.buf_count = tx->buf_count;
+    rc = pal_stream_set_buffer_size(*handle, &in_buf_cfg, &out_buf_cfg);
+    if (rc) {
+        pw_log_error("pal_stream_set_buffer_size failed for voip tx %d", rc);
+        pal_stream_close(*handle);
+        *handle = NULL;
+    }
+    return rc;
+}
+
+static void pw_pal_duplex_close_tx(struct pw_userdata *udata, pal_stream_handle_t *handle)
+{
+    int rc;
+
+    pal_stream_stop(handle);
+    if ((rc = pal_stream_close(handle)))
+        pw_log_error("could not close voip tx handle %p", handle);
+    PW_PAL_TRACE(close, udata->tx.node_id, rc);
+}
+
+static void pw_pal_duplex_close(struct pw_userdata *udata)
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    pal_stream_handle_t *handle;
+
+    close_pal_stream(udata);
+    if ((handle = pw_pal_handle_unpublish(&tx->handle, &tx->users)))
+        pw_pal_duplex_close_tx(udata, handle);
+}
+
+/* RX and TX are opened first and then started back to back, so the DSP
+ * sees both directions from the same point in time. The TX handle is only
+ * handed to the data thread once it runs. */
+static void pw_pal_duplex_start(struct pw_userdata *udata)
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    pal_stream_handle_t *handle;
+    int rc = -EIO;
+
+    if (pw_pal_duplex_open_tx(udata, &handle))
+        return;
+
+    pw_pal_stream_start(udata);
+    if (udata->stream_handle)
+        rc = pal_stream_start(handle);
+    PW_PAL_TRACE(start, tx->node_id, rc);
+    if (rc) {
+        pw_log_error("could not start voip session");
+        pw_pal_duplex_close_tx(udata, handle);
+        pw_pal_duplex_close(udata);
+        return;
+    }
+
+    SPA_ATOMIC_STORE(tx->sync, 1);
+    SPA_ATOMIC_STORE(tx->handle, handle);
+}
+
+/* Main thread: the PAL pair stays open while either graph node runs. */
+static void pw_pal_duplex_update(struct pw_userdata *udata)
+{
+    bool active = false;
+
+    if (udata->stream)
+        active |= pw_stream_get_state(udata->stream, NULL) == PW_STREAM_STATE_STREAMING;
+    if (udata->tx.stream)
+        active |= pw_stream_get_state(udata->tx.stream, NULL) == PW_STREAM_STATE_STREAMING;
+
+    if (active && udata->stream_handle == NULL)
+        pw_pal_duplex_start(udata);
+    else if (!active && udata->stream_handle)
+        pw_pal_duplex_close(udata);
+}
+
+/* Main thread: the capture session stays open while any consumer runs. */
+static void pw_pal_fanout_update(struct pw_userdata *udata)
+{
+    struct pw_pal_fanout *fanout = &udata->fanout;
+    struct pw_stream *stream;
+    uint32_t i;
+
+    fanout->active = 0;
+    for (i = 0; i < fanout->n_taps; i++) {
+        stream = i == 0 ? udata->stream : fanout->taps[i].stream;
+        if (stream && pw_stream_get_state(stream, NULL) == PW_STREAM_STATE_STREAMING)
+            fanout->active++;
+    }
+
+    if (fanout->active && udata->stream_handle == NULL)
+        pw_pal_stream_start(udata);
+    else if (!fanout->active && udata->stream_handle)
+        close_pal_stream(udata);
+}
+
+static void pw_pal_change_stream_state(void *d, enum pw_stream_state old,
+        enum pw_stream_state state, const char *error)
+{
+    struct pw_userdata *udata = d;
+
+    udata->node_id = pw_stream_get_node_id(udata->stream);
+    PW_PAL_TRACE(state, udata->node_id, old, state);
+
+    if (udata->is_duplex && (state == PW_STREAM_STATE_PAUSED ||
+            state == PW_STREAM_STATE_STREAMING)) {
+        pw_pal_duplex_update(udata);
+        return;
+    }
+    if (udata->fanout.enabled && (state == PW_STREAM_STATE_PAUSED ||
+            state == PW_STREAM_STATE_STREAMING)) {
+        if (state == PW_STREAM_STATE_STREAMING)
+            SPA_ATOMIC_STORE(udata->fanout.taps[0].sync, 1);
+        pw_pal_fanout_update(udata);
+        return;
+    }
+    /* the loopback session follows its Props, not the graph state */
+    if (udata->is_loopback && (state == PW_STREAM_STATE_PAUSED ||
+            state == PW_STREAM_STATE_STREAMING))
+        return;
+
+    switch (state) {
+    case PW_STREAM_STATE_ERROR:
+    case PW_STREAM_STATE_UNCONNECTED:
+        pw_impl_module_schedule_destroy(udata->module);
+        break;
+    case PW_STREAM_STATE_PAUSED:
+        /* made inactive by power mode, the DSP keeps playing */
+        if (udata->is_offload && udata->offload.inactive)
+            break;
+        /* keep the compress session, paused with its queued data */
+        if (udata->is_offload)
+            pw_pal_offload_pause(udata);
+        else
+            close_pal_stream(udata);
+        break;
+    case PW_STREAM_STATE_STREAMING:
+        if (udata->is_offload && udata->stream_handle)
+            pw_pal_offload_resume(udata);
+        else
+            pw_pal_stream_start(udata);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Runs on the data thread. The settings are (re)applied whenever the node
+ * lands on a different thread, e.g. after being moved to another loop. */
+static void pw_pal_thread_apply_sched(struct pw_userdata *udata)
+{
+    struct pw_pal_thread_sched *sched = &udata->sched;
+    struct sched_param param;
+    pthread_t self = pthread_self();
+    int rc;
+
+    if (sched->applied && pthread_equal(sched->thread, self))
+        return;
+
+    sched->thread = self;
+    sched->applied = true;
+    udata->stats.thread_id = (int32_t)syscall(SYS_gettid);
+    if (!sched->has_affinity && sched->rt_priority <= 0)
+        return;
+
+    if (sched->has_affinity) {
+        rc = pthread_setaffinity_np(self, sizeof(sched->cpu_set), &sched->cpu_set);
+        if (rc)
+            pw_log_error("could not set affinity of thread %d: %s",
+                    udata->stats.thread_id, strerror(rc));
+    }
+    if (sched->rt_priority > 0) {
+        spa_zero(param);
+        param.sched_priority = sched->rt_priority;
+        rc = pthread_setschedparam(self, SCHED_FIFO, &param);
+        if (rc)
+            pw_log_error("could not set SCHED_FIFO:%d for thread %d: %s",
+                    sched->rt_priority, udata->stats.thread_id, strerror(rc));
+    }
+}
+
+static void pw_pal_stats_update_cycle(struct pw_userdata *udata, uint64_t start_ns)
+{
+    struct pw_pal_stats *stats = &udata->stats;
+    uint64_t now = pw_pal_get_time_ns();
+    uint64_t elapsed = now - start_ns;
+    struct rusage usage;
+    int cpu = sched_getcpu();
+
+    stats->cycles++;
+    stats->cycle_ns_total += elapsed;
+    stats->cycle_ns_max = SPA_MAX(stats->cycle_ns_max, elapsed);
+    if (SPA_ATOMIC_LOAD(udata->first_cycle) && SPA_ATOMIC_CAS(udata->first_cycle, 1, 0))
+        stats->first_cycle_ns = elapsed;
+
+    if (cpu >= 0 && stats->cpu != cpu) {
+        if (stats->cycles > 1)
+            stats->migrations++;
+        stats->cpu = cpu;
+    }
+
+    /* context switch counters need a syscall, sample them sparsely */
+    if (now - stats->last_rusage_ns >= PW_STATS_RUSAGE_INTERVAL_NS &&
+        getrusage(RUSAGE_THREAD, &usage) == 0) {
+        stats->nvcsw = usage.ru_nvcsw;
+        stats->nivcsw = usage.ru_nivcsw;
+        stats->last_rusage_ns = now;
+    }
+
+    SPA_ATOMIC_INC(udata->stats_seq);
+    udata->stats_copy = *stats;
+    SPA_ATOMIC_INC(udata->stats_seq);
+}
+
+/* Data thread: commits the fragment being filled and writes what PAL
+ * takes. Returns true once everything staged is in PAL. */
+static bool pw_pal_offload_tail_written(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+
+    if (offload->pool.mem == NULL)
+        return true;
+    pw_pal_pool_commit(&offload->pool);
+    return pw_pal_pool_write(udata);
+}
+
+/* Data thread: returns true while graph buffers must stay queued, i.e.
+ * until PAL confirmed the track boundary or a full drain. */
+static bool pw_pal_offload_hold(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    int rc;
+
+    switch (SPA_ATOMIC_LOAD(offload->state)) {
+    case PW_PAL_OFFLOAD_PARTIAL_DRAIN:
+    case PW_PAL_OFFLOAD_DRAIN:
+    case PW_PAL_OFFLOAD_DRAINED:
+        return true;
+    case PW_PAL_OFFLOAD_NEXT_TRACK:
+        pw_pal_offload_set_gapless(udata);
+        offload->transitions++;
+        offload->transition_ns = pw_pal_get_time_ns() - offload->partial_drain_start_ns;
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_RUNNING);
+        break;
+    default:
+        break;
+    }
+
+    if (SPA_ATOMIC_LOAD(offload->next_track) && offload->pending == NULL) {
+        /* the tail of the current track must be in PAL before the boundary */
+        if (!pw_pal_offload_tail_written(udata))
+            return true;
+        SPA_ATOMIC_STORE(offload->next_track, false);
+        offload->partial_drain_start_ns = pw_pal_get_time_ns();
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_PARTIAL_DRAIN);
+        rc = pal_stream_drain(udata->stream_handle, PAL_DRAIN_PARTIAL);
+        if (rc) {
+            pw_log_error("partial drain failed for %p error %d", udata->stream_handle, rc);
+            SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_NEXT_TRACK);
+        }
+        return true;
+    }
+
+    if (SPA_ATOMIC_LOAD(offload->drain) && offload->pending == NULL) {
+        if (!pw_pal_offload_tail_written(udata))
+            return true;
+        SPA_ATOMIC_STORE(offload->drain, false);
+        SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_DRAIN);
+        rc = pal_stream_drain(udata->stream_handle, PAL_DRAIN);
+        if (rc) {
+            pw_log_error("pal_stream_drain failed for %p error %d", udata->stream_handle, rc);
+            SPA_ATOMIC_STORE(offload->state, PW_PAL_OFFLOAD_DRAINED);
+        }
+        pw_loop_signal_event(pw_context_get_main_loop(udata->context), offload->drain_event);
+        return true;
+    }
+    return false;
+}
+
+/* Data thread, power mode: copy graph buffers into the fragment pool and
+ * hand PAL whole fragments only. A graph buffer that does not fit is kept
+ * until a fragment frees up. */
+static void pw_pal_process_offload_pool(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct pw_pal_fragment_pool *pool = &offload->pool;
+    struct spa_data *bd;
+    uint32_t offs, size, avail, idx;
+    uint64_t wakeups;
+
+    pw_pal_pool_write(udata);
+
+    while (pool->n_full < pool->count) {
+        if (offload->pending == NULL) {
+            if ((offload->pending = pw_stream_dequeue_buffer(udata->stream)) == NULL)
+                break;
+            offload->pending_offset = 0;
+        }
+
+        bd = &offload->pending->buffer->datas[0];
+        offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
+        size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
+
+        if (offload->pending_offset < size) {
+            idx = (pool->head + pool->n_full) % pool->count;
+            avail = SPA_MIN(size - offload->pending_offset, pool->size - pool->fill);
+            memcpy(pool->mem + (size_t)idx * pool->size + pool->fill,
+                    SPA_PTROFF(bd->data, offs + offload->pending_offset, void), avail);
+            pool->fill += avail;
+            offload->pending_offset += avail;
+
+            if (pool->fill == pool->size)
+                pw_pal_pool_commit(pool);
+            if (offload->pending_offset < size)
+                continue;
+        }
+
+        pw_stream_queue_buffer(udata->stream, offload->pending);
+        offload->pending = NULL;
+    }
+
+    wakeups = SPA_ATOMIC_LOAD(offload->wakeups);
+    if (pw_pal_pool_write(udata) || pool->n_full < pool->count)
+        return;
+    /* nothing fits until the DSP asks for more, which may have happened
+     * since the write */
+    SPA_ATOMIC_STORE(offload->idle, 1);
+    if (SPA_ATOMIC_LOAD(offload->wakeups) != wakeups)
+        SPA_ATOMIC_CAS(offload->idle, 1, 0);
+    else
+        pw_loop_signal_event(pw_context_get_main_loop(udata->context), offload->idle_event);
+}
+
+/* Data thread: drop what the graph queued while the DSP is down. */
+static void pw_pal_offload_discard(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct pw_buffer *buf;
+
+    if (offload->pending) {
+        pw_stream_queue_buffer(udata->stream, offload->pending);
+        offload->pending = NULL;
+    }
+    while ((buf = pw_stream_dequeue_buffer(udata->stream)) != NULL)
+        pw_stream_queue_buffer(udata->stream, buf);
+}
+
+/* Data thread: PAL writes are non-blocking for compress offload, a buffer
+ * it only partially accepts is kept and continued in the next cycle. */
+static void pw_pal_process_offload(struct pw_userdata *udata)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    struct spa_data *bd;
+    struct pal_buffer pal_buf;
+    uint32_t offs, size;
+    ssize_t rc;
+
+    if (udata->stream_handle == NULL)
+        return;
+    if (pw_pal_ssr_discard(udata)) {
+        pw_pal_offload_discard(udata);
+        return;
+    }
+    if (pw_pal_offload_hold(udata))
+        return;
+
+    if (offload->pool.mem) {
+        pw_pal_process_offload_pool(udata);
+        return;
+    }
+
+    while (true) {
+        if (offload->pending == NULL) {
+            if ((offload->pending = pw_stream_dequeue_buffer(udata->stream)) == NULL)
+                break;
+            offload->pending_offset = 0;
+        }
+
+        bd = &offload->pending->buffer->datas[0];
+        offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
+        size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
+
+        if (offload->pending_offset < size) {
+            memset(&pal_buf, 0, sizeof(struct pal_buffer));
+            pal_buf.buffer = SPA_PTROFF(bd->data, offs + offload->pending_offset, void);
+            pal_buf.size = size - offload->pending_offset;
+
+            pw_pal_offload_account_write(offload);
+            PW_PAL_TRACE(write_entry, udata->node_id, pal_buf.size);
+            rc = pal_stream_write(udata->stream_handle, &pal_buf);
+            PW_PAL_TRACE(write_exit, udata->node_id, pal_buf.size, rc);
+            rc = pw_pal_ssr_check(udata, rc);
+            if (rc < 0) {
+                pw_log_error("Could not write data: %zd %d", rc, __LINE__);
+                rc = pal_buf.size;
+            }
+            offload->pending_offset += rc;
+            if (offload->pending_offset < size)
+                break;
+        }
+
+        pw_stream_queue_buffer(udata->stream, offload->pending);
+        offload->pending = NULL;
+    }
+}
+
+/* Data thread: returns true when the buffer was held for the start. After
+ * the start, the buffer is queued behind what was held beyond the pre-roll
+ * and the cycle's one write takes the live amount plus up to one period of
+ * that backlog from its front. */
+static bool pw_pal_prime_hold(struct pw_userdata *udata, void **data, uint32_t *size)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+    struct pw_loop *loop = pw_context_get_main_loop(udata->context);
+    uint32_t held, room;
+
+    switch (SPA_ATOMIC_LOAD(prime->state)) {
+    case PW_PAL_PRIME_OPENING:
+    case PW_PAL_PRIME_OPENED:
+    case PW_PAL_PRIME_READY:
+        /* the main thread only reads below the fill it saw */
+        if (*size <= prime->size - prime->fill) {
+            memcpy(prime->buf + prime->fill, *data, *size);
+            SPA_ATOMIC_STORE(prime->fill, prime->fill + *size);
+        } else {
+            prime->dropped += *size;
+        }
+        if (prime->fill >= prime->target &&
+            SPA_ATOMIC_CAS(prime->state, PW_PAL_PRIME_OPENED, PW_PAL_PRIME_READY))
+            pw_loop_signal_event(loop, prime->event);
+        return true;
+    case PW_PAL_PRIME_RUNNING:
+        if ((held = prime->fill - prime->handed) == 0) {
+            prime->fill = 0;
+            prime->handed = 0;
+            SPA_ATOMIC_CAS(prime->state, PW_PAL_PRIME_RUNNING, PW_PAL_PRIME_IDLE);
+            return false;
+        }
+        if (*size > prime->size - prime->fill) {
+            memmove(prime->buf, prime->buf + prime->handed, held);
+            prime->fill = held;
+            prime->handed = 0;
+        }
+        room = SPA_MIN(*size, prime->size - prime->fill);
+        memcpy(prime->buf + prime->fill, *data, room);
+        prime->fill += room;
+        prime->dropped += *size - room;
+        *data = prime->buf + prime->handed;
+        *size = SPA_MIN(held, prime->period) + room;
+        prime->handed += *size;
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* Data thread: hand one graph buffer of PCM to PAL. */
+static int pw_pal_write_pcm(struct pw_userdata *udata, void *data, uint32_t size)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+    pal_stream_handle_t *handle;
+    struct pal_buffer pal_buf;
+    uint64_t start_ns, end_ns;
+    bool pinned = false;
+    int rc;
+
+    if (pw_pal_ssr_discard(udata))
+        return 0;
+    /* the session is being opened, keep the audio for its first periods */
+    if (prime->periods && pw_pal_prime_hold(udata, &data, &size))
+        return 0;
+    /* an idle session has nothing to feed */
+    if (udata->silence.hold_ns && pw_pal_silence_skip(udata, &data, &size))
+        return 0;
+    handle = udata->latency.enabled ?
+        pw_pal_latency_cycle(udata, size, &pinned) : udata->stream_handle;
+    if (handle == NULL)
+        return 0;
+
+    memset(&pal_buf, 0, sizeof(struct pal_buffer));
+    pal_buf.buffer = data;
+    pal_buf.size = size;
+
+    start_ns = pw_pal_get_time_ns();
+    PW_PAL_TRACE(write_entry, udata->node_id, size);
+    rc = pal_stream_write(handle, &pal_buf);
+    PW_PAL_TRACE(write_exit, udata->node_id, size, rc);
+    end_ns = pw_pal_get_time_ns();
+    udata->stats.pal_ns_total += end_ns - start_ns;
+    if (pinned)
+        pw_pal_handle_unpin(&udata->latency.users);
+    else if (udata->latency.enabled && rc >= 0)
+        udata->latency.last_write_ns = end_ns;
+    rc = pw_pal_ssr_check(udata, rc);
+    if (rc < 0)
+        pw_log_error("Could not write data: %d %d", rc, __LINE__);
+    else if (SPA_ATOMIC_LOAD(prime->first_write) && SPA_ATOMIC_CAS(prime->first_write, 1, 0))
+        prime->first_sound_ns = pw_pal_get_time_ns() - prime->start_ns;
+    return rc;
+}
+
+/* Data thread: fill one graph buffer from PAL. */
+static int pw_pal_read_pcm(struct pw_userdata *udata, pal_stream_handle_t *handle,
+        void *data, uint32_t size)
+{
+    struct pal_buffer pal_buf;
+    uint64_t start_ns;
+    int rc;
+
+    if (handle == NULL)
+        return 0;
+    if (pw_pal_ssr_discard(udata)) {
+        memset(data, 0, size);
+        return 0;
+    }
+
+    memset(&pal_buf, 0, sizeof(struct pal_buffer));
+    pal_buf.buffer = data;
+    pal_buf.size = size;
+
+    start_ns = pw_pal_get_time_ns();
+    PW_PAL_TRACE(read_entry, udata->node_id, size);
+    rc = pal_stream_read(handle, &pal_buf);
+    PW_PAL_TRACE(read_exit, udata->node_id, size, rc);
+    udata->stats.pal_ns_total += pw_pal_get_time_ns() - start_ns;
+    rc = pw_pal_ssr_check(udata, rc);
+    if (rc < 0)
+        pw_log_error("Could not read data: %d %d", rc, __LINE__);
+    pw_log_trace("read buffer data %p with up to %u bytes", data, size);
+    return rc;
+}
+
+/* Data thread: read the period at pos, claimed in fill_pos, from PAL into
+ * the fan-out ring. */
+static int pw_pal_fanout_fill(struct pw_userdata *udata, uint64_t pos)
+{
+    struct pw_pal_fanout *fanout = &udata->fanout;
+    uint8_t *dst = fanout->ring + pos % fanout->size;
+    pal_stream_handle_t *handle;
+    int rc = 0;
+
+    if ((handle = pw_pal_handle_pin(&fanout->handle, &fanout->users)) != NULL) {
+        rc = pw_pal_read_pcm(udata, handle, dst, fanout->period);
+        pw_pal_handle_unpin(&fanout->users);
+        if (rc < 0) {
+            /* give the period back, the next consumer tries again */
+            SPA_ATOMIC_STORE(fanout->fill_pos, pos);
+            return rc;
+        }
+    } else {
+        /* no session, the consumers get silence */
+        memset(dst, 0, fanout->period);
+    }
+    SPA_ATOMIC_STORE(fanout->write_pos, pos + fanout->period);
+    return 0;
+}
+
+/* Data thread of any consumer: copy up to size bytes for this consumer,
+ * reading from PAL when it is ahead of everyone else. A consumer that runs
+ * short while another one reads from PAL does not wait for it, it takes
+ * what the ring has. */
+static void pw_pal_fanout_read(struct pw_userdata *udata, struct pw_pal_tap *tap,
+        void *data, uint32_t size)
+{
+    struct pw_pal_fanout *fanout = &udata->fanout;
+    uint64_t wpos = SPA_ATOMIC_LOAD(fanout->write_pos);
+    uint32_t want, avail, offs, first;
+    int rc;
+
+    if (SPA_ATOMIC_LOAD(tap->sync)) {
+        tap->read_pos = wpos;
+        SPA_ATOMIC_STORE(tap->sync, 0);
+    }
+    /* the period after the write position may be filling right now */
+    want = SPA_MIN(size, fanout->size - fanout->period);
+
+    while (wpos - tap->read_pos < want) {
+        if (!SPA_ATOMIC_CAS(fanout->fill_pos, wpos, wpos + fanout->period)) {
+            /* a fill finished since wpos was loaded, or one is running */
+            wpos = SPA_ATOMIC_LOAD(fanout->write_pos);
+            if (SPA_ATOMIC_LOAD(fanout->fill_pos) != wpos)
+                break;
+            continue;
+        }
+        rc = pw_pal_fanout_fill(udata, wpos);
+        wpos = SPA_ATOMIC_LOAD(fanout->write_pos);
+        if (rc < 0)
+            break;
+    }
+
+    while (true) {
+        if (wpos - tap->read_pos > fanout->size - fanout->period) {
+            tap->overruns++;
+            tap->read_pos = wpos - want;
+        }
+        avail = SPA_MIN((uint64_t)want, wpos - tap->read_pos);
+        offs = tap->read_pos % fanout->size;
+        first = SPA_MIN(avail, fanout->size - offs);
+        memcpy(data, fanout->ring + offs, first);
+        memcpy(SPA_PTROFF(data, first, void), fanout->ring, avail - first);
+        /* a period claimed meanwhile overwrites the ring up to fill_pos - size */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (SPA_ATOMIC_LOAD(fanout->fill_pos) <= tap->read_pos + fanout->size)
+            break;
+        wpos = SPA_ATOMIC_LOAD(fanout->write_pos);
+        tap->read_pos = wpos - want;
+        tap->overruns++;
+    }
+    if (avail < size) {
+        memset(SPA_PTROFF(data, avail, void), 0, size - avail);
+        tap->underruns++;
+    }
+    tap->read_pos += avail;
+    tap->lag = wpos - tap->read_pos;
+    tap->lag_max = SPA_MAX(tap->lag_max, tap->lag);
+}
+
+/* Data thread: fill one graph buffer of the module's own source node. */
+static int pw_pal_capture(struct pw_userdata *udata, void *data, uint32_t size)
+{
+    if (!udata->fanout.enabled)
+        return pw_pal_read_pcm(udata, udata->stream_handle, data, size);
+    pw_pal_fanout_read(udata, &udata->fanout.taps[0], data, size);
+    return size;
+}
+
+/* Data thread: how late this cycle started after the driver woke up. */
+static inline void pw_pal_stats_wakeup(struct pw_userdata *udata, uint64_t start_ns)
+{
+    struct spa_io_position *position = udata->latency.position;
+    uint64_t wakeup;
+
+    if (position == NULL || position->clock.nsec == 0 || start_ns < position->clock.nsec)
+        return;
+    wakeup = start_ns - position->clock.nsec;
+    udata->stats.wakeup_ns_total += wakeup;
+    udata->stats.wakeup_ns_max = SPA_MAX(udata->stats.wakeup_ns_max, wakeup);
+}
+
+static void pw_pal_process_stream(void *d)
+{
+    struct pw_userdata *udata = d;
+    struct pw_buffer *buf;
+    struct spa_data *bd;
+    void *data;
+    uint32_t offs, size;
+    int rc = 0;
+    uint64_t start_ns = pw_pal_get_time_ns();
+
+    PW_PAL_TRACE(process_entry, udata->node_id, udata->stats.cycles);
+    pw_pal_thread_apply_sched(udata);
+    pw_pal_stats_wakeup(udata, start_ns);
+
+    if (udata->is_offload) {
+        pw_pal_process_offload(udata);
+        pw_pal_stats_update_cycle(udata, start_ns);
+        PW_PAL_TRACE(process_exit, udata->node_id, 0, 0);
+        return;
+    }
+
+    if ((buf = pw_stream_dequeue_buffer(udata->stream)) == NULL) {
+        pw_log_error("out of buffers: %m");
+        PW_PAL_TRACE(process_exit, udata->node_id, 0, -EPIPE);
+        return;
+    }
+
+    bd = &buf->buffer->datas[0];
+    if (udata->isplayback) {
+        offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
+        size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
+        data = SPA_PTROFF(bd->data, offs, void);
+
+        rc = pw_pal_write_pcm(udata, data, size);
+        if (udata->is_duplex)
+            SPA_ATOMIC_STORE(udata->tx.rx_frames, udata->tx.rx_frames + size / udata->frame_size);
+    } else {
+        data = bd->data;
+        size = buf->requested ? buf->requested * udata->frame_size : bd->maxsize;
+        size = SPA_MIN(size, bd->maxsize);
+
+        rc = pw_pal_capture(udata, data, size);
+
+        bd->chunk->size = size;
+        bd->chunk->stride = udata->frame_size;
+        bd->chunk->offset = 0;
+        buf->size = size / udata->frame_size;
+    }
+
+    pw_stream_queue_buffer(udata->stream, buf);
+    pw_pal_stats_update_cycle(udata, start_ns);
+    PW_PAL_TRACE(process_exit, udata->node_id, size, rc);
+}
+
+/* Data thread, TX cycle: frame alignment against RX and cycle timing. */
+static void pw_pal_duplex_update_cycle(struct pw_pal_duplex *tx, uint32_t frames,
+        uint64_t start_ns, uint64_t pal_ns, bool silent)
+{
+    struct pw_pal_duplex_stats *stats = &tx->stats;
+    uint64_t elapsed = pw_pal_get_time_ns() - start_ns;
+    int64_t skew;
+
+    if (frames) {
+        if (SPA_ATOMIC_LOAD(tx->sync) && SPA_ATOMIC_CAS(tx->sync, 1, 0)) {
+            tx->rx_base = SPA_ATOMIC_LOAD(tx->rx_frames);
+            tx->tx_frames = 0;
+            stats->frame_skew_max = 0;
+        }
+        tx->tx_frames += frames;
+        skew = (int64_t)(SPA_ATOMIC_LOAD(tx->rx_frames) - tx->rx_base - tx->tx_frames);
+        if (tx->tx_frames == frames)
+            stats->frame_skew = skew;
+        stats->frame_skew_max = SPA_MAX(stats->frame_skew_max,
+                skew > stats->frame_skew ? skew - stats->frame_skew : stats->frame_skew - skew);
+    }
+
+    stats->cycles++;
+    stats->cycle_ns_total += elapsed;
+    stats->cycle_ns_max = SPA_MAX(stats->cycle_ns_max, elapsed);
+    stats->pal_ns_total += pal_ns;
+    if (silent)
+        stats->silent_cycles++;
+
+    SPA_ATOMIC_INC(tx->stats_seq);
+    tx->stats_copy = *stats;
+    SPA_ATOMIC_INC(tx->stats_seq);
+}
+
+static void pw_pal_duplex_process_tx(void *d)
+{
+    struct pw_userdata *udata = d;
+    struct pw_pal_duplex *tx = &udata->tx;
+    pal_stream_handle_t *handle;
+    struct pw_buffer *buf;
+    struct spa_data *bd;
+    struct pal_buffer pal_buf;
+    uint32_t size;
+    uint64_t start_ns = pw_pal_get_time_ns(), pal_ns = 0;
+    ssize_t rc;
+
+    if ((buf = pw_stream_dequeue_buffer(tx->stream)) == NULL)
+        return;
+
+    bd = &buf->buffer->datas[0];
+    size = buf->requested ? buf->requested * udata->frame_size : bd->maxsize;
+    size = SPA_MIN(size, bd->maxsize);
+
+    memset(&pal_buf, 0, sizeof(struct pal_buffer));
+    pal_buf.buffer = bd->data;
+    pal_buf.size = size;
+    rc = -EIO;
+    handle = pw_pal_handle_pin(&tx->handle, &tx->users);
+    /* the RX side acknowledges a DSP restart for both handles */
+    if (handle && SPA_ATOMIC_LOAD(udata->ssr.state) == PW_PAL_SSR_ONLINE) {
+        PW_PAL_TRACE(read_entry, tx->node_id, size);
+        pal_ns = pw_pal_get_time_ns();
+        rc = pal_stream_read(handle, &pal_buf);
+        pal_ns = pw_pal_get_time_ns() - pal_ns;
+        PW_PAL_TRACE(read_exit, tx->node_id, size, rc);
+        if (rc == -ENETRESET)
+            pw_pal_ssr_offline(udata, PW_PAL_SSR_OFFLINE);
+    }
+    if (handle)
+        pw_pal_handle_unpin(&tx->users);
+    if (rc < 0)
+        memset(bd->data, 0, size);
+
+    bd->chunk->size = size;
+    bd->chunk->stride = udata->frame_size;
+    bd->chunk->offset = 0;
+    buf->size = size / udata->frame_size;
+
+    pw_stream_queue_buffer(tx->stream, buf);
+    pw_pal_duplex_update_cycle(tx, handle ? size / udata->frame_size : 0,
+            start_ns, pal_ns, rc < 0);
+}
+
+/* The graph negotiated the buffers, map them in before the first cycle.
+ * user_data marks a locked buffer. */
+static void pw_pal_add_buffer(void *data, struct pw_buffer *buf)
+{
+    struct pw_userdata *udata = data;
+    struct spa_data *d = &buf->buffer->datas[0];
+
+    if (d->data && pw_pal_lock_memory(udata, d->data, d->maxsize))
+        buf->user_data = d->data;
+}
+
+static void pw_pal_remove_buffer(void *data, struct pw_buffer *buf)
+{
+    struct pw_userdata *udata = data;
+
+    if (udata->offload.pending == buf)
+        udata->offload.pending = NULL;
+    if (buf->user_data) {
+        pw_pal_unlock_memory(udata, buf->user_data, buf->buffer->datas[0].maxsize);
+        buf->user_data = NULL;
+    }
+}
+
+static void pw_pal_duplex_destroy_stream(void *d)
+{
+    struct pw_userdata *udata = d;
+
+    spa_hook_remove(&udata->tx.stream_listener);
+    udata->tx.stream = NULL;
+}
+
+static void pw_pal_duplex_change_stream_state(void *d, enum pw_stream_state old,
+        enum pw_stream_state state, const char *error)
+{
+    struct pw_userdata *udata = d;
+
+    udata->tx.node_id = pw_stream_get_node_id(udata->tx.stream);
+    PW_PAL_TRACE(state, udata->tx.node_id, old, state);
+
+    switch (state) {
+    case PW_STREAM_STATE_ERROR:
+    case PW_STREAM_STATE_UNCONNECTED:
+        pw_impl_module_schedule_destroy(udata->module);
+        break;
+    case PW_STREAM_STATE_PAUSED:
+    case PW_STREAM_STATE_STREAMING:
+        pw_pal_duplex_update(udata);
+        break;
+    default:
+        break;
+    }
+}
+
+static const struct pw_stream_events pw_pal_duplex_stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .destroy = pw_pal_duplex_destroy_stream,
+    .state_changed = pw_pal_duplex_change_stream_state,
+    .add_buffer = pw_pal_add_buffer,
+    .remove_buffer = pw_pal_remove_buffer,
+    .process = pw_pal_duplex_process_tx,
+};
+
+static void pw_pal_tap_process(void *d)
+{
+    struct pw_pal_tap *tap = d;
+    struct pw_userdata *udata = tap->udata;
+    struct pw_buffer *buf;
+    struct spa_data *bd;
+    uint32_t size;
+
+    if ((buf = pw_stream_dequeue_buffer(tap->stream)) == NULL)
+        return;
+
+    bd = &buf->buffer->datas[0];
+    size = buf->requested ? buf->requested * udata->frame_size : bd->maxsize;
+    size = SPA_MIN(size, bd->maxsize);
+
+    PW_PAL_TRACE(process_entry, tap->node_id, 0);
+    pw_pal_fanout_read(udata, tap, bd->data, size);
+
+    bd->chunk->size = size;
+    bd->chunk->stride = udata->frame_size;
+    bd->chunk->offset = 0;
+    buf->size = size / udata->frame_size;
+
+    pw_stream_queue_buffer(tap->stream, buf);
+    PW_PAL_TRACE(process_exit, tap->node_id, size, 0);
+}
+
+static void pw_pal_tap_add_buffer(void *d, struct pw_buffer *buf)
+{
+    struct pw_pal_tap *tap = d;
+
+    pw_pal_add_buffer(tap->udata, buf);
+}
+
+static void pw_pal_tap_remove_buffer(void *d, struct pw_buffer *buf)
+{
+    struct pw_pal_tap *tap = d;
+
+    pw_pal_remove_buffer(tap->udata, buf);
+}
+
+static void pw_pal_tap_destroy_stream(void *d)
+{
+    struct pw_pal_tap *tap = d;
+
+    spa_hook_remove(&tap->stream_listener);
+    tap->stream = NULL;
+}
+
+static void pw_pal_tap_change_stream_state(void *d, enum pw_stream_state old,
+        enum pw_stream_state state, const char *error)
+{
+    struct pw_pal_tap *tap = d;
+
+    tap->node_id = pw_stream_get_node_id(tap->stream);
+    PW_PAL_TRACE(state, tap->node_id, old, state);
+
+    switch (state) {
+    case PW_STREAM_STATE_ERROR:
+        /* only this consumer goes away, the stream can't be destroyed
+         * from its own callback */
+        pw_log_error("capture tap %s failed: %s",
+                pw_properties_get(tap->props, PW_KEY_NODE_NAME), error ? error : "");
+        tap->failed = true;
+        pw_loop_signal_event(pw_context_get_main_loop(tap->udata->context),
+                tap->udata->fanout.reap_event);
+        break;
+    case PW_STREAM_STATE_STREAMING:
+        SPA_ATOMIC_STORE(tap->sync, 1);
+        /* fallthrough */
+    case PW_STREAM_STATE_PAUSED:
+        pw_pal_fanout_update(tap->udata);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Main thread: destroy the taps that failed, the others keep running. */
+static void pw_pal_tap_reap(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_tap *tap;
+    uint32_t i;
+
+    for (i = 1; i < udata->fanout.n_taps; i++) {
+        tap = &udata->fanout.taps[i];
+        if (tap->failed && tap->stream)
+            pw_stream_destroy(tap->stream);
+        tap->failed = false;
+    }
+    pw_pal_fanout_update(udata);
+}
+
+static const struct pw_stream_events pw_pal_tap_stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .destroy = pw_pal_tap_destroy_stream,
+    .state_changed = pw_pal_tap_change_stream_state,
+    .add_buffer = pw_pal_tap_add_buffer,
+    .remove_buffer = pw_pal_tap_remove_buffer,
+    .process = pw_pal_tap_process,
+};
+
+/* Gapless control for compress offload, set through the Props params, e.g.
+ * pw-cli s <node> Props '{ params = [ "compress.encoder-delay" 529
+ *     "compress.encoder-padding" 1152 "compress.next-track" true ] }'
+ * The delay/padding apply to the track that follows the next boundary.
+ * "compress.drain" true marks the end of the stream: what is queued plays
+ * out and the session is restarted for the next one. */
+static void pw_pal_parse_offload_params(struct pw_userdata *udata, const struct spa_pod *param)
+{
+    struct pw_pal_offload *offload = &udata->offload;
+    const struct spa_pod_object *obj = (const struct spa_pod_object *)param;
+    const struct spa_pod_prop *prop;
+    struct spa_pod_parser prs;
+    struct spa_pod_frame f;
+    const char *name;
+    struct spa_pod *pod;
+    uint64_t gapless = SPA_ATOMIC_LOAD(offload->next_gapless);
+    uint32_t delay = gapless >> 32, padding = gapless & UINT32_MAX;
+    bool bval, next_track = false, drain = false;
+    int32_t ival;
+
+    if (!spa_pod_is_object_type(param, SPA_TYPE_OBJECT_Props))
+        return;
+
+    SPA_POD_OBJECT_FOREACH(obj, prop) {
+        if (prop->key != SPA_PROP_params)
+            continue;
+
+        spa_pod_parser_pod(&prs, &prop->value);
+        if (spa_pod_parser_push_struct(&prs, &f) < 0)
+            return;
+
+        while (spa_pod_parser_get_string(&prs, &name) >= 0) {
+            if (spa_streq(name, "compress.encoder-delay") &&
+                spa_pod_parser_get_int(&prs, &ival) >= 0) {
+                delay = SPA_MAX(ival, 0);
+            } else if (spa_streq(name, "compress.encoder-padding") &&
+                spa_pod_parser_get_int(&prs, &ival) >= 0) {
+                padding = SPA_MAX(ival, 0);
+            } else if (spa_streq(name, "compress.next-track") &&
+                spa_pod_parser_get_bool(&prs, &bval) >= 0) {
+                next_track |= bval;
+            } else if (spa_streq(name, "compress.drain") &&
+                spa_pod_parser_get_bool(&prs, &bval) >= 0) {
+                drain |= bval;
+            } else if (spa_pod_parser_get_pod(&prs, &pod) < 0) {
+                break;
+            }
+        }
+    }
+
+    /* the metadata is published before the boundary that uses it */
+    SPA_ATOMIC_STORE(offload->next_gapless, (uint64_t)delay << 32 | padding);
+    if (next_track)
+        SPA_ATOMIC_STORE(offload->next_track, true);
+    if (drain)
+        SPA_ATOMIC_STORE(offload->drain, true);
+    /* an idle stream would not see the request until the DSP wants data */
+    if ((next_track || drain) && offload->inactive)
+        pw_pal_offload_wake(udata);
+}
+
+/* Loopback control through the standard Props: mute disables the DSP
+ * path, volume (or the loudest channelVolumes entry) is the gain. */
+static void pw_pal_parse_loopback_props(struct pw_userdata *udata, const struct spa_pod *param)
+{
+    struct pw_pal_loopback *loopback = &udata->loopback;
+    float volume = loopback->gain, volumes[SPA_AUDIO_MAX_CHANNELS];
+    bool mute = !loopback->enabled;
+    struct spa_pod *channel_volumes = NULL;
+    uint32_t i, n_volumes;
+
+    if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_Props, NULL,
+            SPA_PROP_volume, SPA_POD_OPT_Float(&volume),
+            SPA_PROP_mute, SPA_POD_OPT_Bool(&mute),
+            SPA_PROP_channelVolumes, SPA_POD_OPT_Pod(&channel_volumes)) < 0)
+        return;
+
+    if (channel_volumes) {
+        n_volumes = spa_pod_copy_array(channel_volumes, SPA_TYPE_Float,
+                volumes, SPA_AUDIO_MAX_CHANNELS);
+        for (i = 0; i < n_volumes; i++)
+            volume = i == 0 ? volumes[i] : SPA_MAX(volume, volumes[i]);
+    }
+
+    loopback->gain = SPA_CLAMP(volume, 0.0f, 1.0f);
+    loopback->enabled = !mute;
+
+    if (loopback->enabled && udata->stream_handle == NULL)
+        pw_pal_stream_start(udata);
+    else if (!loopback->enabled && udata->stream_handle)
+        close_pal_stream(udata);
+    else if (udata->stream_handle)
+        pw_pal_set_volume(udata, udata->stream_handle, loopback->gain);
+
+    pw_log_info("loopback %s gain %f", loopback->enabled ? "enabled" : "disabled",
+            loopback->gain);
+}
+
+/* Per consumer counters, published on the consumer's own node. */
+static uint32_t pw_pal_fanout_stats(struct pw_userdata *udata, struct pw_pal_tap *tap,
+        struct spa_dict_item *items, char values[][32])
+{
+    uint64_t bytes_per_sec = (uint64_t)udata->info.rate * udata->frame_size;
+    uint64_t lag_us = tap->lag * SPA_USEC_PER_SEC / bytes_per_sec;
+    uint64_t lag_max_us = tap->lag_max * SPA_USEC_PER_SEC / bytes_per_sec;
+
+    snprintf(values[0], sizeof(values[0]), "%" PRIu64, lag_us);
+    snprintf(values[1], sizeof(values[1]), "%" PRIu64, lag_max_us);
+    snprintf(values[2], sizeof(values[2]), "%" PRIu64, tap->overruns);
+    snprintf(values[3], sizeof(values[3]), "%" PRIu64, tap->underruns);
+    items[0] = SPA_DICT_ITEM_INIT("pal.stats.fanout.lag-us", values[0]);
+    items[1] = SPA_DICT_ITEM_INIT("pal.stats.fanout.lag-max-us", values[1]);
+    items[2] = SPA_DICT_ITEM_INIT("pal.stats.fanout.overruns", values[2]);
+    items[3] = SPA_DICT_ITEM_INIT("pal.stats.fanout.underruns", values[3]);
+    return 4;
+}
+
+/* TX counters, published on the capture node itself. */
+static uint32_t pw_pal_duplex_stats(struct pw_userdata *udata,
+        struct spa_dict_item *items, char values[][32])
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    struct pw_pal_duplex_stats stats;
+    uint32_t seq;
+
+    do {
+        seq = SPA_ATOMIC_LOAD(tx->stats_seq);
+        stats = tx->stats_copy;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != SPA_ATOMIC_LOAD(tx->stats_seq));
+
+    snprintf(values[0], sizeof(values[0]), "%" PRIu64, stats.cycles);
+    snprintf(values[1], sizeof(values[1]), "%" PRIu64,
+            stats.cycles ? stats.cycle_ns_total / stats.cycles : 0);
+    snprintf(values[2], sizeof(values[2]), "%" PRIu64, stats.cycle_ns_max);
+    snprintf(values[3], sizeof(values[3]), "%" PRIu64,
+            stats.cycles ? (stats.cycle_ns_total - stats.pal_ns_total) / stats.cycles : 0);
+    snprintf(values[4], sizeof(values[4]), "%" PRIu64, stats.silent_cycles);
+    snprintf(values[5], sizeof(values[5]), "%" PRIi64, stats.frame_skew);
+    snprintf(values[6], sizeof(values[6]), "%" PRIi64, stats.frame_skew_max);
+    items[0] = SPA_DICT_ITEM_INIT("pal.stats.cycles", values[0]);
+    items[1] = SPA_DICT_ITEM_INIT("pal.stats.cycle.avg-ns", values[1]);
+    items[2] = SPA_DICT_ITEM_INIT("pal.stats.cycle.max-ns", values[2]);
+    items[3] = SPA_DICT_ITEM_INIT("pal.stats.cycle.overhead-avg-ns", values[3]);
+    items[4] = SPA_DICT_ITEM_INIT("pal.stats.voip.tx-silent-cycles", values[4]);
+    items[5] = SPA_DICT_ITEM_INIT("pal.stats.voip.frame-skew", values[5]);
+    items[6] = SPA_DICT_ITEM_INIT("pal.stats.voip.frame-skew-max", values[6]);
+    return 7;
+}
+
+/* Main thread: a consistent copy of what the data thread counted. */
+static void pw_pal_stats_read(struct pw_userdata *udata, struct pw_pal_stats *stats)
+{
+    uint32_t seq;
+
+    do {
+        seq = SPA_ATOMIC_LOAD(udata->stats_seq);
+        *stats = udata->stats_copy;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != SPA_ATOMIC_LOAD(udata->stats_seq));
+}
+
+static void pw_pal_stats_publish(struct pw_userdata *udata)
+{
+    struct pw_pal_stats copy, *stats = &copy;
+    struct spa_dict_item items[PW_MAX_STATS];
+    char values[PW_MAX_STATS][32];
+    uint32_t n_items = 0;
+    uint64_t now = pw_pal_get_time_ns();
+    uint64_t wakeups, wakeups_per_min = 0;
+    struct pw_pal_tap *tap;
+    uint32_t i;
+
+    pw_pal_stats_read(udata, stats);
+    wakeups = SPA_ATOMIC_LOAD(udata->offload.wakeups) + stats->cycles;
+    if (udata->last_publish_ns && now > udata->last_publish_ns)
+        wakeups_per_min = (wakeups - udata->last_wakeups) * 60 * SPA_NSEC_PER_SEC /
+            (now - udata->last_publish_ns);
+    udata->last_publish_ns = now;
+    udata->last_wakeups = wakeups;
+
+#define PW_PAL_STAT(key, fmt, val) do {                                         \
+        snprintf(values[n_items], sizeof(values[n_items]), fmt, val);           \
+        items[n_items] = SPA_DICT_ITEM_INIT(key, values[n_items]);              \
+        n_items++;                                                              \
+    } while (0)
+
+    PW_PAL_STAT("pal.stats.cycles", "%" PRIu64, stats->cycles);
+    PW_PAL_STAT("pal.stats.cycle.avg-ns", "%" PRIu64,
+            stats->cycles ? stats->cycle_ns_total / stats->cycles : 0);
+    PW_PAL_STAT("pal.stats.cycle.max-ns", "%" PRIu64, stats->cycle_ns_max);
+    PW_PAL_STAT("pal.stats.cycle.overhead-avg-ns", "%" PRIu64,
+            stats->cycles ? (stats->cycle_ns_total - stats->pal_ns_total) / stats->cycles : 0);
+    PW_PAL_STAT("pal.stats.cycle.wakeup-avg-ns", "%" PRIu64,
+            stats->cycles ? stats->wakeup_ns_total / stats->cycles : 0);
+    PW_PAL_STAT("pal.stats.cycle.wakeup-max-ns", "%" PRIu64, stats->wakeup_ns_max);
+    PW_PAL_STAT("pal.stats.cycle.first-ns", "%" PRIu64, stats->first_cycle_ns);
+    PW_PAL_STAT("pal.stats.memory.locked-kb", "%" PRIu64,
+            (uint64_t)(SPA_ATOMIC_LOAD(udata->locked_bytes) / 1024));
+    PW_PAL_STAT("pal.stats.thread.id", "%d", stats->thread_id);
+    PW_PAL_STAT("pal.stats.thread.cpu", "%d", stats->cpu);
+    PW_PAL_STAT("pal.stats.thread.migrations", "%" PRIu64, stats->migrations);
+    PW_PAL_STAT("pal.stats.thread.voluntary-switches", "%" PRIu64, stats->nvcsw);
+    PW_PAL_STAT("pal.stats.thread.involuntary-switches", "%" PRIu64, stats->nivcsw);
+    if (udata->is_offload) {
+        PW_PAL_STAT("pal.stats.compress.track-transitions", "%" PRIu64,
+                udata->offload.transitions);
+        PW_PAL_STAT("pal.stats.compress.transition-ns", "%" PRIu64,
+                udata->offload.transition_ns);
+        PW_PAL_STAT("pal.stats.compress.wakeups-per-min", "%" PRIu64, wakeups_per_min);
+        PW_PAL_STAT("pal.stats.compress.max-write-gap-ms", "%" PRIu64,
+                (uint64_t)(SPA_ATOMIC_LOAD(udata->offload.max_write_gap_ns) / SPA_NSEC_PER_MSEC));
+    }
+    if (udata->is_duplex) {
+        /* derived from the configured PAL buffers, not measured */
+        PW_PAL_STAT("pal.stats.voip.configured-buffer-us", "%" PRIu64,
+                (uint64_t)((udata->sink_buf_size * udata->sink_buf_count +
+                 udata->tx.buf_size * udata->tx.buf_count) * SPA_USEC_PER_SEC /
+                 ((uint64_t)udata->frame_size * udata->info.rate)));
+    }
+    if (udata->is_loopback) {
+        PW_PAL_STAT("pal.stats.loopback.enabled", "%s",
+                udata->stream_handle ? "true" : "false");
+        PW_PAL_STAT("pal.stats.loopback.open-start-us", "%" PRIu64,
+                (uint64_t)(udata->loopback.start_ns / SPA_NSEC_PER_USEC));
+    }
+    if (udata->latency.enabled) {
+        PW_PAL_STAT("pal.stats.latency.mode", "%s",
+                udata->stream_type == PAL_STREAM_LOW_LATENCY ? "low-latency" : "deep-buffer");
+        PW_PAL_STAT("pal.stats.latency.switches", "%" PRIu64, udata->latency.switches);
+        PW_PAL_STAT("pal.stats.latency.switch-us", "%" PRIu64,
+                (uint64_t)(udata->latency.switch_ns / SPA_NSEC_PER_USEC));
+        PW_PAL_STAT("pal.stats.latency.dropped-us", "%" PRIu64,
+                (uint64_t)(SPA_ATOMIC_LOAD(udata->latency.dropped) * SPA_USEC_PER_SEC /
+                ((uint64_t)udata->info.rate * udata->frame_size)));
+    }
+    if (udata->silence.hold_ns) {
+        PW_PAL_STAT("pal.stats.silence.standbys", "%" PRIu64, udata->silence.standbys);
+        PW_PAL_STAT("pal.stats.silence.idle-ms", "%" PRIu64,
+                (uint64_t)((udata->silence.idle_ns + (udata->silence.stopped ?
+                    now - udata->silence.standby_start_ns : 0)) / SPA_NSEC_PER_MSEC));
+        PW_PAL_STAT("pal.stats.silence.writes-skipped", "%" PRIu64,
+                SPA_ATOMIC_LOAD(udata->silence.writes_skipped));
+        PW_PAL_STAT("pal.stats.silence.dropped-us", "%" PRIu64,
+                (uint64_t)(SPA_ATOMIC_LOAD(udata->silence.dropped) * SPA_USEC_PER_SEC /
+                ((uint64_t)udata->info.rate * udata->frame_size)));
+    }
+    if (udata->isplayback && !udata->is_offload && !udata->is_duplex && !udata->is_loopback) {
+        PW_PAL_STAT("pal.stats.start.first-sound-us", "%" PRIu64,
+                (uint64_t)(udata->prime.first_sound_ns / SPA_NSEC_PER_USEC));
+        PW_PAL_STAT("pal.stats.start.open-us", "%" PRIu64,
+                (uint64_t)(udata->prime.open_ns / SPA_NSEC_PER_USEC));
+    }
+    if (udata->prime.periods) {
+        PW_PAL_STAT("pal.stats.start.primed-us", "%" PRIu64, (uint64_t)(udata->prime.primed_bytes *
+                SPA_USEC_PER_SEC / ((uint64_t)udata->info.rate * udata->frame_size)));
+        PW_PAL_STAT("pal.stats.start.dropped-us", "%" PRIu64, (uint64_t)(udata->prime.dropped *
+                SPA_USEC_PER_SEC / ((uint64_t)udata->info.rate * udata->frame_size)));
+    }
+    if (udata->combined.enabled) {
+        PW_PAL_STAT("pal.stats.combined.devices", "%u", udata->no_of_devices);
+        PW_PAL_STAT("pal.stats.combined.reroutes", "%" PRIu64, udata->combined.reroutes);
+    }
+    PW_PAL_STAT("pal.stats.ssr.recoveries", "%" PRIu64, udata->ssr.recoveries);
+    PW_PAL_STAT("pal.stats.ssr.recovery-ms", "%" PRIu64,
+            (uint64_t)(udata->ssr.recovery_ns / SPA_NSEC_PER_MSEC));
+    PW_PAL_STAT("pal.stats.ssr.dropped-cycles", "%" PRIu64, udata->ssr.dropped);
+    if (udata->fanout.enabled) {
+        PW_PAL_STAT("pal.stats.fanout.consumers", "%u", udata->fanout.active);
+        n_items += pw_pal_fanout_stats(udata, &udata->fanout.taps[0],
+                &items[n_items], &values[n_items]);
+    }
+#undef PW_PAL_STAT
+
+    if (udata->use_node)
+        pw_impl_node_update_properties(udata->node.impl, &SPA_DICT_INIT(items, n_items));
+    else
+        pw_stream_update_properties(udata->stream, &SPA_DICT_INIT(items, n_items));
+
+    if (udata->is_duplex && udata->tx.stream) {
+        n_items = pw_pal_duplex_stats(udata, items, values);
+        pw_stream_update_properties(udata->tx.stream, &SPA_DICT_INIT(items, n_items));
+    }
+    for (i = 1; i < udata->fanout.n_taps; i++) {
+        tap = &udata->fanout.taps[i];
+        if (tap->stream == NULL)
+            continue;
+        n_items = pw_pal_fanout_stats(udata, tap, items, values);
+        pw_stream_update_properties(tap->stream, &SPA_DICT_INIT(items, n_items));
+    }
+}
+
+static void on_stats_timeout(void *data, uint64_t expirations)
+{
+    struct pw_userdata *udata = data;
+
+    if ((udata->stream || udata->node.impl) && (SPA_ATOMIC_LOAD(udata->stats_seq) || udata->is_loopback ||
+            udata->fanout.active || SPA_ATOMIC_LOAD(udata->tx.stats_seq)))
+        pw_pal_stats_publish(udata);
+}
+
+static int pw_pal_stats_register(struct pw_userdata *udata)
+{
+    struct pw_loop *loop = pw_context_get_main_loop(udata->context);
+    struct timespec interval;
+
+    if (udata->stats_interval_ms == 0)
+        return 0;
+
+    udata->stats_timer = pw_loop_add_timer(loop, on_stats_timeout, udata);
+    if (udata->stats_timer == NULL)
+        return -errno;
+
+    interval.tv_sec = udata->stats_interval_ms / SPA_MSEC_PER_SEC;
+    interval.tv_nsec = (udata->stats_interval_ms % SPA_MSEC_PER_SEC) * SPA_NSEC_PER_MSEC;
+    pw_loop_update_timer(loop, udata->stats_timer, &interval, &interval, false);
+    return 0;
+}
+
+static void pw_pal_io_changed(void *data, uint32_t id, void *area, uint32_t size)
+{
+    struct pw_userdata *udata = data;
+
+    if (id == SPA_IO_Position)
+        udata->latency.position = area;
+}
+
+static void pw_pal_change_stream_param(void *data, uint32_t id, const struct spa_pod *param) {
+    struct pw_userdata *udata = data;
+
+    if (param != NULL && id == SPA_PARAM_Props && udata->is_offload) {
+        pw_pal_parse_offload_params(udata, param);
+        return;
+    }
+    if (param != NULL && id == SPA_PARAM_Props && udata->is_loopback) {
+        pw_pal_parse_loopback_props(udata, param);
+        return;
+    }
+    if (param == NULL || id != SPA_PARAM_Format)
+        return;
+    if (spa_format_parse(param, &udata->format.media_type, &udata->format.media_subtype) < 0)
+        return;
+    if (udata->format.media_type == SPA_MEDIA_TYPE_audio &&
+        udata->format.media_subtype == SPA_MEDIA_SUBTYPE_raw) {
+        spa_format_audio_raw_parse(param, &udata->format.info.raw);
+    } else {
+        pw_log_info("Compressed format detected: subtype=%u", udata->format.media_subtype);
+    }
+}
+static const struct pw_stream_events pw_pal_stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .destroy = pw_pal_destroy_stream,
+    .state_changed = pw_pal_change_stream_state,
+    .process = pw_pal_process_stream,
+    .io_changed = pw_pal_io_changed,
+    .param_changed = pw_pal_change_stream_param,
+    .add_buffer = pw_pal_add_buffer,
+    .remove_buffer = pw_pal_remove_buffer,
+};
+
+static int pw_pal_create_stream(struct pw_userdata *udata)
+{
+    int res;
+    uint32_t n_params = 0;
+    const struct spa_pod *params[2];
+    uint8_t buffer[1024];
+    struct spa_pod_builder b;
+
+    spa_pod_builder_init(&b, buffer, sizeof(buffer));
+    /* pw_stream_new() takes ownership of the properties, hand it a copy so
+     * stream_props stays valid until pw_pal_userdata_destroy() */
+    if (udata->isplayback) {
+        udata->stream = pw_stream_new(udata->core, "example sink",
+                pw_properties_copy(udata->stream_props));
+        if (udata->is_offload) {
+            params[n_params++] = spa_pod_builder_add_object(&b,
+                            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                            SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->sink_buf_count),
+                            SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(0),
+                            SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->sink_buf_size),
+                            SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                            SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                            SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
+        } else {
+            params[n_params++] = spa_pod_builder_add_object(&b,
+                            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                            SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->sink_buf_count),
+                            SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+                            SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->sink_buf_size),
+                            SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                            SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                            SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
+        }
+    } else {
+        udata->stream = pw_stream_new(udata->core, "example source",
+                pw_properties_copy(udata->stream_props));
+        params[n_params++] = spa_pod_builder_add_object(&b,
+                        SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                        SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->source_buf_count),
+                        SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+                        SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->source_buf_size),
+                        SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                        SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                        SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
+    }
+
+    if (udata->stream == NULL)
+        return -errno;
+
+    pw_stream_add_listener(udata->stream,
+            &udata->stream_listener,
+            &pw_pal_stream_events, udata);
+
+    if (udata->is_offload) {
+        params[n_params++] =  spa_pod_builder_add_object(&b,
+                        SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_audio),
+                        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_mp3),
+                        SPA_FORMAT_AUDIO_format, SPA_POD_Id(SPA_AUDIO_FORMAT_ENCODED),
+                        SPA_FORMAT_AUDIO_rate, SPA_POD_Int(44100),
+                        SPA_FORMAT_AUDIO_channels, SPA_POD_Int(2));
+    } else {
+        params[n_params++] = spa_format_audio_raw_build(&b,
+                        SPA_PARAM_EnumFormat, &udata->info);
+    }
+
+    res = pw_stream_connect(udata->stream,
+              udata->isplayback ? PW_DIRECTION_INPUT : PW_DIRECTION_OUTPUT,
+              PW_ID_ANY,
+              (udata->is_loopback ? PW_STREAM_FLAG_INACTIVE : PW_STREAM_FLAG_AUTOCONNECT) |
+              PW_STREAM_FLAG_NO_CONVERT |
+              PW_STREAM_FLAG_MAP_BUFFERS |
+              PW_STREAM_FLAG_RT_PROCESS,
+              params, n_params);
+
+    if (udata->is_offload)
+        pw_stream_set_active(udata->stream, true);
+
+   return 0;
+}
+
+static int pw_pal_duplex_create_stream(struct pw_userdata *udata)
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    const struct spa_pod *params[2];
+    uint8_t buffer[1024];
+    struct spa_pod_builder b;
+
+    tx->stream = pw_stream_new(udata->core, "voip source", pw_properties_copy(tx->props));
+    if (tx->stream == NULL)
+        return -errno;
+
+    pw_stream_add_listener(tx->stream, &tx->stream_listener,
+            &pw_pal_duplex_stream_events, udata);
+
+    spa_pod_builder_init(&b, buffer, sizeof(buffer));
+    params[0] = spa_pod_builder_add_object(&b,
+                    SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                    SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(tx->buf_count),
+                    SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+                    SPA_PARAM_BUFFERS_size,    SPA_POD_Int(tx->buf_size),
+                    SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                    SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                    SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
+    params[1] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &udata->info);
+
+    return pw_stream_connect(tx->stream,
+              PW_DIRECTION_OUTPUT,
+              PW_ID_ANY,
+              PW_STREAM_FLAG_AUTOCONNECT |
+              PW_STREAM_FLAG_NO_CONVERT |
+              PW_STREAM_FLAG_MAP_BUFFERS |
+              PW_STREAM_FLAG_RT_PROCESS,
+              params, 2);
+}
+
+/* Extra source nodes reading from the main node's capture session; their
+ * buffers hold up to half the ring so each can run at its own quantum. */
+static int pw_pal_fanout_create_streams(struct pw_userdata *udata)
+{
+    struct pw_pal_fanout *fanout = &udata->fanout;
+    struct pw_pal_tap *tap;
+    const struct spa_pod *params[2];
+    uint8_t buffer[1024];
+    struct spa_pod_builder b;
+    uint32_t i;
+    int res;
+
+    for (i = 1; i < fanout->n_taps; i++) {
+        tap = &fanout->taps[i];
+        tap->stream = pw_stream_new(udata->core, "capture tap", pw_properties_copy(tap->props));
+        if (tap->stream == NULL)
+            return -errno;
+
+        pw_stream_add_listener(tap->stream, &tap->stream_listener,
+                &pw_pal_tap_stream_events, tap);
+
+        spa_pod_builder_init(&b, buffer, sizeof(buffer));
+        params[0] = spa_pod_builder_add_object(&b,
+                        SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                        SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->source_buf_count),
+                        SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+                        SPA_PARAM_BUFFERS_size,    SPA_POD_Int(fanout->size / 2),
+                        SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                        SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                        SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
+        params[1] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &udata->info);
+
+        res = pw_stream_connect(tap->stream,
+                  PW_DIRECTION_OUTPUT,
+                  PW_ID_ANY,
+                  PW_STREAM_FLAG_AUTOCONNECT |
+                  PW_STREAM_FLAG_NO_CONVERT |
+                  PW_STREAM_FLAG_MAP_BUFFERS |
+                  PW_STREAM_FLAG_RT_PROCESS,
+                  params, 2);
+        if (res < 0)
+            return res;
+    }
+    return 0;
+}
+
+static void pw_pal_node_emit_info(struct pw_userdata *udata, bool full)
+{
+    struct pw_pal_node *n = &udata->node;
+    uint64_t old_mask;
+
+    old_mask = full ? n->info.change_mask : 0;
+    if (full)
+        n->info.change_mask = SPA_NODE_CHANGE_MASK_FLAGS | SPA_NODE_CHANGE_MASK_PARAMS;
+    if (n->info.change_mask) {
+        spa_node_emit_info(&n->hooks, &n->info);
+        n->info.change_mask = old_mask;
+    }
+
+    old_mask = full ? n->port_info.change_mask : 0;
+    if (full)
+        n->port_info.change_mask = SPA_PORT_CHANGE_MASK_FLAGS | SPA_PORT_CHANGE_MASK_PARAMS;
+    if (n->port_info.change_mask) {
+        spa_node_emit_port_info(&n->hooks, n->direction, 0, &n->port_info);
+        n->port_info.change_mask = old_mask;
+    }
+}
+
+/* Main thread: flip the serials so the graph reads the latency again. */
+static void pw_pal_node_update_latency(struct pw_userdata *udata)
+{
+    struct pw_pal_node *n = &udata->node;
+
+    n->params[PW_PAL_NODE_ProcessLatency].flags ^= SPA_PARAM_INFO_SERIAL;
+    n->info.change_mask |= SPA_NODE_CHANGE_MASK_PARAMS;
+    n->port_params[PW_PAL_PORT_Latency].flags ^= SPA_PARAM_INFO_SERIAL;
+    n->port_info.change_mask |= SPA_PORT_CHANGE_MASK_PARAMS;
+    pw_pal_node_emit_info(udata, false);
+}
+
+/* Data thread: pass the buffer the graph produced for us on to PAL. */
+static int pw_pal_node_consume(struct pw_userdata *udata, uint32_t *size, int *rc)
+{
+    struct pw_pal_node *n = &udata->node;
+    struct spa_io_buffers *io = n->io;
+    struct spa_data *d;
+    uint32_t offs;
+
+    if (io->status != SPA_STATUS_HAVE_DATA)
+        return SPA_STATUS_NEED_DATA;
+    if (io->buffer_id >= n->n_buffers) {
+        io->status = -EINVAL;
+        return -EINVAL;
+    }
+
+    d = &n->buffers[io->buffer_id]->datas[0];
+    offs = SPA_MIN(d->chunk->offset, d->maxsize);
+    *size = SPA_MIN(d->chunk->size, d->maxsize - offs);
+    *rc = pw_pal_write_pcm(udata, SPA_PTROFF(d->data, offs, void), *size);
+
+    io->status = SPA_STATUS_NEED_DATA;
+    return SPA_STATUS_HAVE_DATA;
+}
+
+/* Data thread: read one quantum from PAL into a free buffer. */
+static int pw_pal_node_produce(struct pw_userdata *udata, uint32_t *size, int *rc)
+{
+    struct pw_pal_node *n = &udata->node;
+    struct spa_io_buffers *io = n->io;
+    struct spa_data *d;
+    uint32_t id, frames;
+
+    if (io->status == SPA_STATUS_HAVE_DATA)
+        return SPA_STATUS_HAVE_DATA;
+    if (io->buffer_id < n->n_buffers) {
+        n->free_mask |= 1u << io->buffer_id;
+        io->buffer_id = SPA_ID_INVALID;
+    }
+    if (n->free_mask == 0) {
+        spa_node_call_xrun(&n->callbacks, 0, 0, NULL);
+        return -EPIPE;
+    }
+
+    id = __builtin_ctz(n->free_mask);
+    n->free_mask &= ~(1u << id);
+    d = &n->buffers[id]->datas[0];
+
+    frames = n->position ? n->position->clock.duration : udata->source_buf_size / udata->frame_size;
+    *size = SPA_MIN(frames * udata->frame_size, d->maxsize);
+    *rc = pw_pal_read_pcm(udata, udata->stream_handle, d->data, *size);
+
+    d->chunk->offset = 0;
+    d->chunk->size = *size;
+    d->chunk->stride = udata->frame_size;
+
+    io->buffer_id = id;
+    io->status = SPA_STATUS_HAVE_DATA;
+    return SPA_STATUS_HAVE_DATA;
+}
+
+static int pw_pal_node_process(void *object)
+{
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+    uint64_t start_ns = pw_pal_get_time_ns();
+    uint32_t size = 0;
+    int status, rc = 0;
+
+    if (n->io == NULL || n->n_buffers == 0)
+        return -EIO;
+
+    PW_PAL_TRACE(process_entry, udata->node_id, udata->stats.cycles);
+    pw_pal_thread_apply_sched(udata);
+    pw_pal_stats_wakeup(udata, start_ns);
+
+    if (n->direction == SPA_DIRECTION_INPUT)
+        status = pw_pal_node_consume(udata, &size, &rc);
+    else
+        status = pw_pal_node_produce(udata, &size, &rc);
+
+    pw_pal_stats_update_cycle(udata, start_ns);
+    PW_PAL_TRACE(process_exit, udata->node_id, size, rc);
+    return status;
+}
+
+static int pw_pal_node_add_listener(void *object, struct spa_hook *listener,
+        const struct spa_node_events *events, void *data)
+{
+    struct pw_userdata *udata = object;
+    struct spa_hook_list save;
+
+    spa_hook_list_isolate(&udata->node.hooks, &save, listener, events, data);
+    pw_pal_node_emit_info(udata, true);
+    spa_hook_list_join(&udata->node.hooks, &save);
+    return 0;
+}
+
+static int pw_pal_node_set_callbacks(void *object,
+        const struct spa_node_callbacks *callbacks, void *data)
+{
+    struct pw_userdata *udata = object;
+
+    udata->node.callbacks = SPA_CALLBACKS_INIT(callbacks, data);
+    return 0;
+}
+
+static int pw_pal_node_sync(void *object, int seq)
+{
+    struct pw_userdata *udata = object;
+
+    spa_node_emit_result(&udata->node.hooks, seq, 0, 0, NULL);
+    return 0;
+}
+
+static int pw_pal_node_enum_params(void *object, int seq, uint32_t id,
+        uint32_t start, uint32_t num, const struct spa_pod *filter)
+{
+    struct pw_userdata *udata = object;
+    struct spa_process_latency_info info;
+    struct spa_result_node_params result;
+    struct spa_pod_builder b;
+    struct spa_pod *param;
+    uint8_t buffer[256];
+
+    if (id != SPA_PARAM_ProcessLatency)
+        return -ENOENT;
+    if (start > 0 || num == 0)
+        return 0;
+
+    spa_zero(info);
+    info.ns = udata->latency_ns;
+    spa_pod_builder_init(&b, buffer, sizeof(buffer));
+    param = spa_process_latency_build(&b, id, &info);
+
+    result.id = id;
+    result.index = 0;
+    result.next = 1;
+    if (spa_pod_filter(&b, &result.param, param, filter) < 0)
+        return 0;
+    spa_node_emit_result(&udata->node.hooks, seq, 0, SPA_RESULT_TYPE_NODE_PARAMS, &result);
+    return 0;
+}
+
+static int pw_pal_node_set_param(void *object, uint32_t id, uint32_t flags,
+        const struct spa_pod *param)
+{
+    return -ENOENT;
+}
+
+static int pw_pal_node_set_io(void *object, uint32_t id, void *data, size_t size)
+{
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+
+    switch (id) {
+    case SPA_IO_Clock:
+        break;
+    case SPA_IO_Position:
+        n->position = data;
+        udata->latency.position = data;
+        break;
+    default:
+        return -ENOENT;
+    }
+    return 0;
+}
+
+/* Main thread: the graph starts or stops the node. */
+static int pw_pal_node_send_command(void *object, const struct spa_command *command)
+{
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+
+    switch (SPA_NODE_COMMAND_ID(command)) {
+    case SPA_NODE_COMMAND_Start:
+        if (n->started)
+            return 0;
+        if (!n->have_format || n->n_buffers == 0)
+            return -EIO;
+        pw_pal_stream_start(udata);
+        if (udata->stream_handle == NULL)
+            return -EIO;
+        n->started = true;
+        break;
+    case SPA_NODE_COMMAND_Pause:
+    case SPA_NODE_COMMAND_Suspend:
+        if (!n->started)
+            return 0;
+        n->started = false;
+        close_pal_stream(udata);
+        break;
+    default:
+        return -ENOTSUP;
     }
+    return 0;
+}
 
-    return;
-cleanup:
-    if (close_pal_stream(udata))
-        pw_log_error("could not close sink handle %p", udata->stream_handle);
-exit:
-    return;
+static int pw_pal_node_add_port(void *object, enum spa_direction direction,
+        uint32_t port_id, const struct spa_dict *props)
+{
+    return -ENOTSUP;
+}
 
+static int pw_pal_node_remove_port(void *object, enum spa_direction direction, uint32_t port_id)
+{
+    return -ENOTSUP;
 }
-static void pw_pal_change_stream_state(void *d, enum pw_stream_state old,
-        enum pw_stream_state state, const char *error)
+
+static int pw_pal_node_port_enum_params(void *object, int seq,
+        enum spa_direction direction, uint32_t port_id,
+        uint32_t id, uint32_t start, uint32_t num, const struct spa_pod *filter)
 {
-    struct pw_userdata *udata = d;
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+    struct spa_pod *param;
+    struct spa_pod_builder b;
+    struct spa_result_node_params result;
+    struct spa_latency_info latency;
+    uint8_t buffer[1024];
+    uint32_t count = 0, size, n_bufs;
 
-    switch (state) {
-    case PW_STREAM_STATE_ERROR:
-    case PW_STREAM_STATE_UNCONNECTED:
-        pw_impl_module_schedule_destroy(udata->module);
+    if (direction != n->direction || port_id != 0)
+        return -EINVAL;
+
+    result.id = id;
+    result.next = start;
+next:
+    result.index = result.next++;
+    spa_pod_builder_init(&b, buffer, sizeof(buffer));
+
+    switch (id) {
+    case SPA_PARAM_EnumFormat:
+        if (result.index > 0)
+            return 0;
+        param = spa_format_audio_raw_build(&b, id, &udata->info);
         break;
-    case PW_STREAM_STATE_PAUSED:
-        close_pal_stream(udata);
+    case SPA_PARAM_Format:
+        if (!n->have_format)
+            return -EIO;
+        if (result.index > 0)
+            return 0;
+        param = spa_format_audio_raw_build(&b, id, &n->format);
         break;
-    case PW_STREAM_STATE_STREAMING:
-        pw_pal_stream_start(udata);
+    case SPA_PARAM_Buffers:
+        if (!n->have_format)
+            return -EIO;
+        if (result.index > 0)
+            return 0;
+        if (n->direction == SPA_DIRECTION_INPUT) {
+            n_bufs = udata->sink_buf_count;
+            size = udata->sink_buf_size;
+        } else {
+            n_bufs = udata->source_buf_count;
+            size = udata->source_buf_size;
+        }
+        param = spa_pod_builder_add_object(&b,
+                SPA_TYPE_OBJECT_ParamBuffers, id,
+                SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(
+                        SPA_MIN(n_bufs, PW_NODE_MAX_BUFFERS), 1, PW_NODE_MAX_BUFFERS),
+                SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+                SPA_PARAM_BUFFERS_size,    SPA_POD_Int(size),
+                SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size),
+                SPA_PARAM_BUFFERS_align,   SPA_POD_Int(PW_PAL_BUFFER_ALIGN),
+                SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(PW_PAL_BUFFER_TYPES));
         break;
-    default:
+    case SPA_PARAM_IO:
+        if (result.index > 0)
+            return 0;
+        param = spa_pod_builder_add_object(&b,
+                SPA_TYPE_OBJECT_ParamIO, id,
+                SPA_PARAM_IO_id,   SPA_POD_Id(SPA_IO_Buffers),
+                SPA_PARAM_IO_size, SPA_POD_Int(sizeof(struct spa_io_buffers)));
+        break;
+    case SPA_PARAM_Latency:
+        if (result.index > 1)
+            return 0;
+        /* the device path adds to what flows through our port */
+        latency = SPA_LATENCY_INFO(result.index);
+        if (result.index == n->direction)
+            latency.min_ns = latency.max_ns = udata->latency_ns;
+        param = spa_latency_build(&b, id, &latency);
         break;
+    default:
+        return -ENOENT;
     }
+
+    if (spa_pod_filter(&b, &result.param, param, filter) < 0)
+        goto next;
+
+    spa_node_emit_result(&n->hooks, seq, 0, SPA_RESULT_TYPE_NODE_PARAMS, &result);
+
+    if (++count != num)
+        goto next;
+    return 0;
 }
 
-static void pw_pal_process_stream(void *d)
+static void pw_pal_node_clear_buffers(struct pw_userdata *udata)
 {
-    struct pw_userdata *udata = d;
-    struct pw_buffer *buf;
-    struct spa_data *bd;
-    void *data;
-    uint32_t offs, size;
-    struct pal_buffer pal_buf;
-    int rc = 0;
-    static int tmp = 0;
+    struct pw_pal_node *n = &udata->node;
+    uint32_t i;
 
-    if ((buf = pw_stream_dequeue_buffer(udata->stream)) == NULL) {
-        pw_log_error("out of buffers: %m");
-        return;
+    for (i = 0; i < n->n_buffers; i++) {
+        if (n->locked_mask & (1u << i))
+            pw_pal_unlock_memory(udata, n->buffers[i]->datas[0].data,
+                    n->buffers[i]->datas[0].maxsize);
     }
+    n->n_buffers = 0;
+    n->locked_mask = 0;
+}
 
-    bd = &buf->buffer->datas[0];
-    memset(&pal_buf, 0, sizeof(struct pal_buffer));
-    if (udata->isplayback) {
-        offs = SPA_MIN(bd->chunk->offset, bd->maxsize);
-        size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
-        data = SPA_PTROFF(bd->data, offs, void);
+static int pw_pal_node_port_set_param(void *object,
+        enum spa_direction direction, uint32_t port_id,
+        uint32_t id, uint32_t flags, const struct spa_pod *param)
+{
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+    struct spa_audio_info info;
+
+    if (direction != n->direction || port_id != 0)
+        return -EINVAL;
+    /* latency of the peers is not used, ours comes from the devices */
+    if (id == SPA_PARAM_Latency)
+        return 0;
+    if (id != SPA_PARAM_Format)
+        return -ENOENT;
 
-        pal_buf.buffer = data;
-        pal_buf.size = size;
+    if (param == NULL) {
+        n->have_format = false;
+        pw_pal_node_clear_buffers(udata);
+    } else {
+        spa_zero(info);
+        if (spa_format_parse(param, &info.media_type, &info.media_subtype) < 0 ||
+            info.media_type != SPA_MEDIA_TYPE_audio ||
+            info.media_subtype != SPA_MEDIA_SUBTYPE_raw ||
+            spa_format_audio_raw_parse(param, &info.info.raw) < 0)
+            return -EINVAL;
+        /* the PAL session is configured for exactly one format */
+        if (info.info.raw.format != udata->info.format ||
+            info.info.raw.rate != udata->info.rate ||
+            info.info.raw.channels != udata->info.channels)
+            return -EINVAL;
+        n->format = info.info.raw;
+        n->have_format = true;
+    }
 
-        if (udata->stream_handle) {
-            if ((rc = pal_stream_write(udata->stream_handle, &pal_buf)) < 0) {
-                pw_log_error("Could not write data: %d %d", rc, __LINE__);
-            }
-        }
+    n->port_info.change_mask |= SPA_PORT_CHANGE_MASK_PARAMS;
+    if (n->have_format) {
+        n->port_info.change_mask |= SPA_PORT_CHANGE_MASK_RATE;
+        n->port_info.rate = SPA_FRACTION(1, n->format.rate);
+        n->port_params[PW_PAL_PORT_Format] = SPA_PARAM_INFO(SPA_PARAM_Format, SPA_PARAM_INFO_READWRITE);
+        n->port_params[PW_PAL_PORT_Buffers] = SPA_PARAM_INFO(SPA_PARAM_Buffers, SPA_PARAM_INFO_READ);
     } else {
-        data = bd->data;
-        size = buf->requested ? buf->requested * udata->frame_size : bd->maxsize;
+        n->port_params[PW_PAL_PORT_Format] = SPA_PARAM_INFO(SPA_PARAM_Format, SPA_PARAM_INFO_WRITE);
+        n->port_params[PW_PAL_PORT_Buffers] = SPA_PARAM_INFO(SPA_PARAM_Buffers, 0);
+    }
+    pw_pal_node_emit_info(udata, false);
+    return 0;
+}
 
-        pal_buf.buffer = data;
-        pal_buf.size = size;
-        /* fill buffer contents here */
-        if (udata->stream_handle) {
-            if ((rc = pal_stream_read(udata->stream_handle, &pal_buf)) < 0) {
-                pw_log_error("Could not read data: %d %d", rc, __LINE__);
-            }
+static int pw_pal_node_port_use_buffers(void *object,
+        enum spa_direction direction, uint32_t port_id,
+        uint32_t flags, struct spa_buffer **buffers, uint32_t n_buffers)
+{
+    struct pw_userdata *udata = object;
+    struct pw_pal_node *n = &udata->node;
+    uint32_t i;
+
+    if (direction != n->direction || port_id != 0)
+        return -EINVAL;
+    if (n_buffers > 0 && !n->have_format)
+        return -EIO;
+    if (n_buffers > PW_NODE_MAX_BUFFERS)
+        return -ENOSPC;
+
+    pw_pal_node_clear_buffers(udata);
+
+    for (i = 0; i < n_buffers; i++) {
+        if (buffers[i]->n_datas < 1 || buffers[i]->datas[0].data == NULL) {
+            pw_log_error("buffer %u of %s is not mapped", i,
+                    pw_properties_get(udata->stream_props, PW_KEY_NODE_NAME));
+            return -EINVAL;
         }
-        pw_log_error("read buffer data %p with up to %u bytes", data, size);
-
-        bd->chunk->size = size;
-        bd->chunk->stride = udata->frame_size;
-        bd->chunk->offset = 0;
-        buf->size = size / udata->frame_size;
+        n->buffers[i] = buffers[i];
     }
-    /* write buffer contents here */
+    for (i = 0; i < n_buffers; i++) {
+        if (pw_pal_lock_memory(udata, buffers[i]->datas[0].data, buffers[i]->datas[0].maxsize))
+            n->locked_mask |= 1u << i;
+    }
+    n->n_buffers = n_buffers;
+    n->free_mask = n_buffers == PW_NODE_MAX_BUFFERS ? UINT32_MAX : (1u << n_buffers) - 1;
+    return 0;
+}
 
-    pw_stream_queue_buffer(udata->stream, buf);
+static int pw_pal_node_port_set_io(void *object,
+        enum spa_direction direction, uint32_t port_id,
+        uint32_t id, void *data, size_t size)
+{
+    struct pw_userdata *udata = object;
+
+    if (direction != udata->node.direction || port_id != 0)
+        return -EINVAL;
+    if (id != SPA_IO_Buffers)
+        return -ENOENT;
+    udata->node.io = data;
+    return 0;
 }
 
-static void pw_pal_change_stream_param(void *data, uint32_t id, const struct spa_pod *param) {
+static int pw_pal_node_port_reuse_buffer(void *object, uint32_t port_id, uint32_t buffer_id)
+{
+    struct pw_userdata *udata = object;
+
+    if (port_id != 0 || buffer_id >= udata->node.n_buffers)
+        return -EINVAL;
+    udata->node.free_mask |= 1u << buffer_id;
+    return 0;
+}
+
+static const struct spa_node_methods pw_pal_node_methods = {
+    SPA_VERSION_NODE_METHODS,
+    .add_listener = pw_pal_node_add_listener,
+    .set_callbacks = pw_pal_node_set_callbacks,
+    .sync = pw_pal_node_sync,
+    .enum_params = pw_pal_node_enum_params,
+    .set_param = pw_pal_node_set_param,
+    .set_io = pw_pal_node_set_io,
+    .send_command = pw_pal_node_send_command,
+    .add_port = pw_pal_node_add_port,
+    .remove_port = pw_pal_node_remove_port,
+    .port_enum_params = pw_pal_node_port_enum_params,
+    .port_set_param = pw_pal_node_port_set_param,
+    .port_use_buffers = pw_pal_node_port_use_buffers,
+    .port_set_io = pw_pal_node_port_set_io,
+    .port_reuse_buffer = pw_pal_node_port_reuse_buffer,
+    .process = pw_pal_node_process,
+};
+
+static void pw_pal_impl_node_destroy(void *data)
+{
     struct pw_userdata *udata = data;
 
-    if (param == NULL || id != SPA_PARAM_Format)
-        return;
-    if (spa_format_parse(param, &udata->format.media_type, &udata->format.media_subtype) < 0)
-        return;
-    if (udata->format.media_type == SPA_MEDIA_TYPE_audio &&
-        udata->format.media_subtype == SPA_MEDIA_SUBTYPE_raw) {
-        spa_format_audio_raw_parse(param, &udata->format.info.raw);
-    } else {
-        pw_log_info("Compressed format detected: subtype=%u", udata->format.media_subtype);
-    }
+    spa_hook_remove(&udata->node.impl_listener);
+    udata->node.impl = NULL;
 }
-static const struct pw_stream_events pw_pal_stream_events = {
-    PW_VERSION_STREAM_EVENTS,
-    .destroy = pw_pal_destroy_stream,
-    .state_changed = pw_pal_change_stream_state,
-    .process = pw_pal_process_stream,
-    .param_changed = pw_pal_change_stream_param
+
+static const struct pw_impl_node_events pw_pal_impl_node_events = {
+    PW_VERSION_IMPL_NODE_EVENTS,
+    .destroy = pw_pal_impl_node_destroy,
 };
 
-static int pw_pal_create_stream(struct pw_userdata *udata)
+static void pw_pal_node_proxy_bound(void *data, uint32_t global_id)
 {
-    int res;
-    uint32_t n_params = 0;
-    const struct spa_pod *params[2];
-    uint8_t buffer[1024];
-    struct spa_pod_builder b;
+    struct pw_userdata *udata = data;
 
-    spa_pod_builder_init(&b, buffer, sizeof(buffer));
-    if (udata->isplayback) {
-        udata->stream = pw_stream_new(udata->core, "example sink", udata->stream_props);
-        if (udata->is_offload) {
-            params[n_params++] = spa_pod_builder_add_object(&b,
-                            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                            SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->sink_buf_count),
-                            SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(0),
-                            SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->sink_buf_size),
-                            SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size));
-        } else {
-            params[n_params++] = spa_pod_builder_add_object(&b,
-                            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                            SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->sink_buf_count),
-                            SPA_PARAM_BUFFERS_blocks,  0,
-                            SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->sink_buf_size),
-                            SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size));
-        }
-    } else {
-        udata->stream = pw_stream_new(udata->core, "example source", udata->stream_props);
-        params[n_params++] = spa_pod_builder_add_object(&b,
-                        SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                        SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(udata->source_buf_count),
-                        SPA_PARAM_BUFFERS_blocks,  0,
-                        SPA_PARAM_BUFFERS_size,    SPA_POD_Int(udata->source_buf_size),
-                        SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(udata->frame_size));
-    }
+    udata->node_id = global_id;
+}
 
-    if (udata->stream == NULL)
+static void pw_pal_node_proxy_destroy(void *data)
+{
+    struct pw_userdata *udata = data;
+
+    spa_hook_remove(&udata->node.proxy_listener);
+    udata->node.proxy = NULL;
+}
+
+static const struct pw_proxy_events pw_pal_node_proxy_events = {
+    PW_VERSION_PROXY_EVENTS,
+    .bound = pw_pal_node_proxy_bound,
+    .destroy = pw_pal_node_proxy_destroy,
+};
+
+static int pw_pal_create_node(struct pw_userdata *udata)
+{
+    struct pw_pal_node *n = &udata->node;
+    struct pw_properties *props;
+    int res;
+
+    n->direction = udata->isplayback ? SPA_DIRECTION_INPUT : SPA_DIRECTION_OUTPUT;
+    spa_hook_list_init(&n->hooks);
+    n->node.iface = SPA_INTERFACE_INIT(SPA_TYPE_INTERFACE_Node, SPA_VERSION_NODE,
+            &pw_pal_node_methods, udata);
+
+    n->info = SPA_NODE_INFO_INIT();
+    n->info.max_input_ports = udata->isplayback ? 1 : 0;
+    n->info.max_output_ports = udata->isplayback ? 0 : 1;
+    n->info.flags = SPA_NODE_FLAG_RT;
+    n->params[PW_PAL_NODE_ProcessLatency] = SPA_PARAM_INFO(SPA_PARAM_ProcessLatency, SPA_PARAM_INFO_READ);
+    n->info.params = n->params;
+    n->info.n_params = PW_PAL_NODE_N_PARAMS;
+
+    n->port_info = SPA_PORT_INFO_INIT();
+    n->port_info.flags = SPA_PORT_FLAG_LIVE | SPA_PORT_FLAG_PHYSICAL | SPA_PORT_FLAG_TERMINAL;
+    n->port_params[PW_PAL_PORT_EnumFormat] = SPA_PARAM_INFO(SPA_PARAM_EnumFormat, SPA_PARAM_INFO_READ);
+    n->port_params[PW_PAL_PORT_IO] = SPA_PARAM_INFO(SPA_PARAM_IO, SPA_PARAM_INFO_READ);
+    n->port_params[PW_PAL_PORT_Format] = SPA_PARAM_INFO(SPA_PARAM_Format, SPA_PARAM_INFO_WRITE);
+    n->port_params[PW_PAL_PORT_Buffers] = SPA_PARAM_INFO(SPA_PARAM_Buffers, 0);
+    n->port_params[PW_PAL_PORT_Latency] = SPA_PARAM_INFO(SPA_PARAM_Latency, SPA_PARAM_INFO_READWRITE);
+    n->port_info.params = n->port_params;
+    n->port_info.n_params = PW_PAL_PORT_N_PARAMS;
+
+    props = pw_properties_copy(udata->stream_props);
+    if (props == NULL)
+        return -errno;
+    n->impl = pw_context_create_node(udata->context, props, 0);
+    if (n->impl == NULL)
         return -errno;
 
-    pw_stream_add_listener(udata->stream,
-            &udata->stream_listener,
-            &pw_pal_stream_events, udata);
+    pw_impl_node_add_listener(n->impl, &n->impl_listener, &pw_pal_impl_node_events, udata);
+    if ((res = pw_impl_node_set_implementation(n->impl, &n->node)) < 0)
+        return res;
 
-    if (udata->is_offload) {
-        params[n_params++] =  spa_pod_builder_add_object(&b,
-                        SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-                        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_audio),
-                        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_mp3),
-                        SPA_FORMAT_AUDIO_format, SPA_POD_Id(SPA_AUDIO_FORMAT_ENCODED),
-                        SPA_FORMAT_AUDIO_rate, SPA_POD_Int(44100),
-                        SPA_FORMAT_AUDIO_channels, SPA_POD_Int(2));
+    /* a node registered in a client's context is not seen by the daemon */
+    if (!pw_properties_get_bool(pw_context_get_properties(udata->context), "core.daemon", false)) {
+        n->proxy = pw_core_export(udata->core, PW_TYPE_INTERFACE_Node, NULL, n->impl, 0);
+        if (n->proxy == NULL)
+            return -errno;
+        /* node_id follows once the daemon bound it */
+        pw_proxy_add_listener(n->proxy, &n->proxy_listener, &pw_pal_node_proxy_events, udata);
     } else {
-        params[n_params++] = spa_format_audio_raw_build(&b,
-                        SPA_PARAM_EnumFormat, &udata->info);
+        if ((res = pw_impl_node_register(n->impl, NULL)) < 0)
+            return res;
+        udata->node_id = pw_global_get_id(pw_impl_node_get_global(n->impl));
     }
+    return pw_impl_node_set_active(n->impl, true);
+}
 
-    res = pw_stream_connect(udata->stream,
-              udata->isplayback ? PW_DIRECTION_INPUT : PW_DIRECTION_OUTPUT,
-              PW_ID_ANY,
-              PW_STREAM_FLAG_AUTOCONNECT |
-              PW_STREAM_FLAG_NO_CONVERT |
-              PW_STREAM_FLAG_MAP_BUFFERS |
-              PW_STREAM_FLAG_RT_PROCESS,
-              params, n_params);
-
-    if (udata->is_offload)
-        pw_stream_set_active(udata->stream, true);
+static void pw_pal_destroy_node(struct pw_userdata *udata)
+{
+    struct pw_pal_node *n = &udata->node;
 
-   return 0;
+    if (n->proxy)
+        pw_proxy_destroy(n->proxy);
+    if (n->impl)
+        pw_impl_node_destroy(n->impl);
 }
 
 static void pw_pal_core_error(void *data, uint32_t id, int seq, int res, const char *message)
@@ -374,49 +3713,270 @@ static void pw_pal_core_error(void *data, uint32_t id, int seq, int res, const c
         pw_impl_module_schedule_destroy(udata->module);
 }
 
-static const struct pw_core_events pw_pal_events_core = {
-    PW_VERSION_CORE_EVENTS,
-    .error = pw_pal_core_error,
-};
+static const struct pw_core_events pw_pal_events_core = {
+    PW_VERSION_CORE_EVENTS,
+    .error = pw_pal_core_error,
+};
+
+static void pw_pal_core_destroy(void *d)
+{
+    struct pw_userdata *udata = d;
+    spa_hook_remove(&udata->core_listener);
+    udata->core = NULL;
+    pw_impl_module_schedule_destroy(udata->module);
+}
+
+static const struct pw_proxy_events pw_pal_proxy_events_core = {
+    .destroy = pw_pal_core_destroy,
+};
+
+static void pw_pal_userdata_destroy(struct pw_userdata *udata)
+{
+    uint32_t i;
+
+    pw_pal_ssr_deinit(udata);
+    if (udata->use_node)
+        pw_pal_destroy_node(udata);
+    if (udata->stream)
+        pw_stream_destroy(udata->stream);
+    if (udata->tx.stream)
+        pw_stream_destroy(udata->tx.stream);
+    for (i = 1; i < udata->fanout.n_taps; i++) {
+        if (udata->fanout.taps[i].stream)
+            pw_stream_destroy(udata->fanout.taps[i].stream);
+        pw_properties_free(udata->fanout.taps[i].props);
+    }
+    if (udata->is_duplex)
+        pw_pal_duplex_close(udata);
+    close_pal_stream(udata);
+    if (udata->fanout.reap_event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->fanout.reap_event);
+    if (udata->offload.drain_event) {
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->offload.drain_event);
+        pthread_cond_destroy(&udata->offload.cond);
+        pthread_mutex_destroy(&udata->offload.lock);
+    }
+    if (udata->offload.drain_timer)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->offload.drain_timer);
+    if (udata->offload.idle_event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->offload.idle_event);
+    if (udata->latency.event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->latency.event);
+    if (udata->latency.playout_timer)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context),
+                udata->latency.playout_timer);
+    if (udata->silence.event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->silence.event);
+    if (udata->prime.event)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->prime.event);
+    pw_pal_arena_deinit(udata);
+    if (udata->stats_timer)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->stats_timer);
+    /* the io source owns jack_fd and closes it on destroy */
+    if (udata->jack_src)
+        pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->jack_src);
+    else if (udata->jack_fd >= 0)
+        close(udata->jack_fd);
+    if (udata->core) {
+        spa_hook_remove(&udata->core_proxy_listener);
+        spa_hook_remove(&udata->core_listener);
+        if (udata->do_disconnect)
+            pw_core_disconnect(udata->core);
+    }
+
+    pw_properties_free(udata->stream_props);
+    pw_properties_free(udata->tx.props);
+    pw_properties_free(udata->props);
+
+    free(udata);
+}
+
+static void pw_pal_module_destroy(void *data)
+{
+    struct pw_userdata *udata = data;
+    spa_hook_remove(&udata->module_listener);
+    pw_pal_userdata_destroy(udata);
+}
+
+static const struct pw_impl_module_events pw_pal_events_module = {
+    PW_VERSION_IMPL_MODULE_EVENTS,
+    .destroy = pw_pal_module_destroy,
+};
+
+static const struct {
+    const char *name;
+    pal_device_id_t id;
+} pw_pal_device_names[] = {
+    { "Speaker", PAL_DEVICE_OUT_SPEAKER },
+    { "Headset", PAL_DEVICE_OUT_WIRED_HEADSET },
+    { "Headphone", PAL_DEVICE_OUT_WIRED_HEADPHONE },
+    { "Handset", PAL_DEVICE_OUT_HANDSET },
+    { "DP", PAL_DEVICE_OUT_AUX_DIGITAL },
+    { "HDMI", PAL_DEVICE_OUT_HDMI },
+    { "SpeakerMic", PAL_DEVICE_IN_SPEAKER_MIC },
+    { "HeadsetMic", PAL_DEVICE_IN_WIRED_HEADSET },
+    { "HandsetMic", PAL_DEVICE_IN_HANDSET_MIC },
+};
+
+static pal_device_id_t pw_pal_device_from_name(const char *name)
+{
+    size_t i;
+    for (i = 0; i < SPA_N_ELEMENTS(pw_pal_device_names); i++) {
+        if (spa_streq(name, pw_pal_device_names[i].name))
+            return pw_pal_device_names[i].id;
+    }
+    return PAL_DEVICE_NONE;
+}
+
+/* "devices = [ Speaker Headset ]", returns the number of devices or a
+ * negative error for an unknown name. */
+static int pw_pal_parse_devices(const char *str, pal_device_id_t *ids, uint32_t max)
+{
+    struct spa_json it[2];
+    char v[64];
+    uint32_t n = 0;
+
+    spa_json_init(&it[0], str, strlen(str));
+    if (spa_json_enter_array(&it[0], &it[1]) <= 0)
+        spa_json_init(&it[1], str, strlen(str));
+
+    while (spa_json_get_string(&it[1], v, sizeof(v)) > 0) {
+        if (n == max) {
+            pw_log_warn("only the first %u devices are used", max);
+            break;
+        }
+        if ((ids[n] = pw_pal_device_from_name(v)) == PAL_DEVICE_NONE) {
+            pw_log_error("unknown device '%s'", v);
+            return -EINVAL;
+        }
+        n++;
+    }
+    return n;
+}
+
+/* "pal.device.latency-us = { Headset = 1500 }" */
+static void pw_pal_parse_device_latency(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct spa_json it[2];
+    const char *str;
+    char key[64];
+    pal_device_id_t id;
+    int us;
+
+    if ((str = pw_properties_get(props, "pal.device.latency-us")) == NULL)
+        return;
+
+    spa_json_init(&it[0], str, strlen(str));
+    if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+        spa_json_init(&it[1], str, strlen(str));
+
+    while (spa_json_get_string(&it[1], key, sizeof(key)) > 0) {
+        if (spa_json_get_int(&it[1], &us) <= 0)
+            break;
+        if ((id = pw_pal_device_from_name(key)) == PAL_DEVICE_NONE || us < 0 ||
+            udata->n_device_latency == MAX_DEVICES) {
+            pw_log_error("ignoring pal.device.latency-us entry %s = %d", key, us);
+            continue;
+        }
+        udata->device_latency[udata->n_device_latency].id = id;
+        udata->device_latency[udata->n_device_latency].us = us;
+        udata->n_device_latency++;
+    }
+}
 
-static void pw_pal_core_destroy(void *d)
+static bool pw_pal_device_behind_jack(const char *jack_name, pal_device_id_t id)
 {
-    struct pw_userdata *udata = d;
-    spa_hook_remove(&udata->core_listener);
-    udata->core = NULL;
-    pw_impl_module_schedule_destroy(udata->module);
+    switch (id) {
+    case PAL_DEVICE_OUT_WIRED_HEADSET:
+    case PAL_DEVICE_OUT_WIRED_HEADPHONE:
+        return strstr(jack_name, "Headset") != NULL;
+    case PAL_DEVICE_OUT_AUX_DIGITAL:
+    case PAL_DEVICE_OUT_HDMI:
+        return strstr(jack_name, "DP") != NULL;
+    default:
+        return false;
+    }
 }
 
-static const struct pw_proxy_events pw_pal_proxy_events_core = {
-    .destroy = pw_pal_core_destroy,
-};
-
-static void pw_pal_userdata_destroy(struct pw_userdata *udata)
+/* Main thread: rebuild the PAL device list from the present devices. The
+ * media config of pal_device[0] is shared by all of them. */
+static void pw_pal_combined_build(struct pw_userdata *udata)
 {
-    if (udata->stream)
-        pw_stream_destroy(udata->stream);
-    if(fcntl(udata->jack_fd, F_GETFD) != 1 || errno != EBADF)
-        close(udata->jack_fd);
-    if (udata->core && udata->do_disconnect)
-        pw_core_disconnect(udata->core);
-
-    pw_properties_free(udata->stream_props);
-    pw_properties_free(udata->props);
+    struct pw_pal_combined *combined = &udata->combined;
+    struct pal_device template = udata->pal_device[0];
+    uint32_t i, n = 0;
 
-    free(udata);
+    for (i = 0; i < combined->n_devices; i++) {
+        if (!(combined->present & (1u << i)))
+            continue;
+        udata->pal_device[n] = template;
+        udata->pal_device[n++].id = combined->devices[i];
+    }
+    /* PAL needs a device, keep the first one when none is present */
+    if (n == 0) {
+        udata->pal_device[n] = template;
+        udata->pal_device[n++].id = combined->devices[0];
+    }
+    udata->no_of_devices = n;
 }
 
-static void pw_pal_module_destroy(void *data)
+static void pw_pal_combined_init(struct pw_userdata *udata)
 {
-    struct pw_userdata *udata = data;
-    spa_hook_remove(&udata->module_listener);
-    pw_pal_userdata_destroy(udata);
+    struct pw_pal_combined *combined = &udata->combined;
+    uint32_t i;
+
+    combined->enabled = true;
+    combined->n_devices = udata->no_of_devices;
+    for (i = 0; i < combined->n_devices; i++) {
+        combined->devices[i] = udata->pal_device_id[i];
+        /* the jack brings its devices in, see handle_jack_boot_event() */
+        if (!pw_pal_device_behind_jack(udata->jack_name, combined->devices[i]))
+            combined->present |= 1u << i;
+    }
+    pw_pal_combined_build(udata);
 }
 
-static const struct pw_impl_module_events pw_pal_events_module = {
-    PW_VERSION_IMPL_MODULE_EVENTS,
-    .destroy = pw_pal_module_destroy,
-};
+/* Main thread: report the slowest active device path as process latency,
+ * so the graph can align this node with other nodes. The devices of one
+ * session all get the same samples from PAL, nothing here can delay one of
+ * them against the others, so a spread between them is only logged. */
+static void pw_pal_update_device_latency(struct pw_userdata *udata)
+{
+    struct spa_process_latency_info info;
+    const struct spa_pod *params[1];
+    struct spa_pod_builder b;
+    uint8_t buffer[256];
+    uint64_t ns = 0, min_ns = UINT64_MAX, dev_ns;
+    uint32_t i, j;
+
+    for (i = 0; i < udata->no_of_devices; i++) {
+        dev_ns = 0;
+        for (j = 0; j < udata->n_device_latency; j++) {
+            if (udata->device_latency[j].id == udata->pal_device[i].id)
+                dev_ns = (uint64_t)udata->device_latency[j].us * SPA_NSEC_PER_USEC;
+        }
+        ns = SPA_MAX(ns, dev_ns);
+        min_ns = SPA_MIN(min_ns, dev_ns);
+    }
+    if (ns == udata->latency_ns)
+        return;
+    if (udata->no_of_devices > 1 && ns > min_ns)
+        pw_log_warn("active devices are %" PRIu64 " us apart, they are not aligned "
+                "within the session", (uint64_t)((ns - min_ns) / SPA_NSEC_PER_USEC));
+    udata->latency_ns = ns;
+    if (udata->use_node) {
+        pw_pal_node_update_latency(udata);
+        return;
+    }
+    if (udata->stream == NULL)
+        return;
+
+    spa_zero(info);
+    info.ns = ns;
+    spa_pod_builder_init(&b, buffer, sizeof(buffer));
+    params[0] = spa_process_latency_build(&b, SPA_PARAM_ProcessLatency, &info);
+    pw_stream_update_params(udata->stream, params, 1);
+}
 
 static inline uint32_t format_from_name(const char *name, size_t len)
 {
@@ -454,6 +4014,45 @@ static void pw_pal_get_parse_position(struct spa_audio_info_raw *info, const cha
     }
 }
 
+static void pw_pal_parse_thread_sched(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct pw_pal_thread_sched *sched = &udata->sched;
+    struct spa_json it[2];
+    const char *str;
+    int cpu;
+
+    CPU_ZERO(&sched->cpu_set);
+    if ((str = pw_properties_get(props, "pal.thread.affinity")) != NULL) {
+        spa_json_init(&it[0], str, strlen(str));
+        if (spa_json_enter_array(&it[0], &it[1]) <= 0)
+            spa_json_init(&it[1], str, strlen(str));
+
+        while (spa_json_get_int(&it[1], &cpu) > 0) {
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                pw_log_error("ignoring invalid cpu %d in pal.thread.affinity", cpu);
+                continue;
+            }
+            CPU_SET(cpu, &sched->cpu_set);
+            sched->has_affinity = true;
+        }
+    }
+
+    sched->rt_priority = pw_properties_get_int32(props, "pal.thread.priority", 0);
+    if (sched->rt_priority > 0) {
+        sched->rt_priority = SPA_CLAMP(sched->rt_priority,
+                sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+    }
+
+    /* the settings apply to the whole thread, never touch the shared
+     * default data loop */
+    if ((sched->has_affinity || sched->rt_priority > 0) &&
+        pw_properties_get(udata->stream_props, PW_KEY_NODE_LOOP_NAME) == NULL) {
+        pw_log_warn("pal.thread.affinity/priority need node.loop.name, ignoring them");
+        sched->has_affinity = false;
+        sched->rt_priority = 0;
+    }
+}
+
 static void pw_pal_fetch_audio_info(const struct pw_properties *props, struct spa_audio_info_raw *info)
 {
     const char *str;
@@ -529,6 +4128,11 @@ static size_t pw_stream_get_buffer_size(struct pw_userdata *udata, struct pal_me
             break;
         case PAL_STREAM_LOW_LATENCY:
             buffer_duration = PW_LOW_LATENCY_BUFFER_DURATION_MS;
+            break;
+        case PAL_STREAM_VOIP_RX:
+        case PAL_STREAM_VOIP_TX:
+            buffer_duration = PW_VOIP_BUFFER_DURATION_MS;
+            break;
         default:
             break;
         }
@@ -540,68 +4144,86 @@ static size_t pw_stream_get_buffer_size(struct pw_userdata *udata, struct pal_me
 }
 static void pw_pal_fill_stream_info(struct pw_userdata *udata)
 {
-    udata->stream_attributes = calloc(1, sizeof(struct pal_stream_attributes));
-    udata->stream_attributes->type = udata->stream_type;
-
-    udata->stream_attributes->info.opt_stream_info.version = 1;
-    udata->stream_attributes->info.opt_stream_info.duration_us = -1;
-    udata->stream_attributes->info.opt_stream_info.has_video = false;
-    udata->stream_attributes->info.opt_stream_info.is_streaming = false;
-    udata->stream_attributes->flags = 0;
-    if (udata->isplayback) {
-        udata->stream_attributes->direction = PAL_AUDIO_OUTPUT;
-        udata->stream_attributes->out_media_config.bit_width = 16;
-        udata->stream_attributes->out_media_config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
-        udata->stream_attributes->out_media_config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+    spa_zero(udata->stream_attributes);
+    udata->stream_attributes.type = udata->stream_type;
+
+    udata->stream_attributes.info.opt_stream_info.version = 1;
+    udata->stream_attributes.info.opt_stream_info.duration_us = -1;
+    udata->stream_attributes.info.opt_stream_info.has_video = false;
+    udata->stream_attributes.info.opt_stream_info.is_streaming = false;
+    udata->stream_attributes.flags = 0;
+    if (udata->is_loopback) {
+        udata->stream_attributes.direction = PAL_AUDIO_INPUT_OUTPUT;
+        udata->stream_attributes.info.opt_stream_info.loopback_type = PAL_STREAM_LOOPBACK_PCM;
+        udata->stream_attributes.in_media_config.sample_rate = udata->info.rate;
+        udata->stream_attributes.in_media_config.bit_width = 16;
+        udata->stream_attributes.in_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
+        udata->stream_attributes.in_media_config.ch_info.channels = udata->info.channels;
+        udata->stream_attributes.in_media_config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
+        udata->stream_attributes.in_media_config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+        udata->stream_attributes.out_media_config = udata->stream_attributes.in_media_config;
+        udata->sink_buf_count = 4;
+        udata->sink_buf_size = pw_stream_get_buffer_size(udata,
+                udata->stream_attributes.out_media_config, PAL_STREAM_LOW_LATENCY);
+    } else if (udata->isplayback) {
+        udata->stream_attributes.direction = PAL_AUDIO_OUTPUT;
+        udata->stream_attributes.out_media_config.bit_width = 16;
+        udata->stream_attributes.out_media_config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
+        udata->stream_attributes.out_media_config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
         udata->sink_buf_count = 4;
         if(!(udata->is_offload)) {
-            udata->stream_attributes->out_media_config.sample_rate = udata->info.rate;
-            switch (udata->stream_attributes->out_media_config.bit_width) {
+            udata->stream_attributes.out_media_config.sample_rate = udata->info.rate;
+            switch (udata->stream_attributes.out_media_config.bit_width) {
                 case 32:
-                    udata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
+                    udata->stream_attributes.out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
                     break;
                 case 24:
-                    udata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
+                    udata->stream_attributes.out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
                     break;
                 default:
-                    udata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
+                    udata->stream_attributes.out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
                     break;
             }
-            udata->stream_attributes->out_media_config.ch_info.channels = udata->info.channels;
-            udata->sink_buf_size = pw_stream_get_buffer_size(udata, udata->stream_attributes->out_media_config, udata->stream_type);
+            udata->stream_attributes.out_media_config.ch_info.channels = udata->info.channels;
+            udata->sink_buf_size = pw_stream_get_buffer_size(udata, udata->stream_attributes.out_media_config, udata->stream_type);
+            if (udata->latency.enabled) {
+                udata->latency.ll_buf_size = pw_stream_get_buffer_size(udata,
+                        udata->stream_attributes.out_media_config, PAL_STREAM_LOW_LATENCY);
+                udata->latency.db_buf_size = pw_stream_get_buffer_size(udata,
+                        udata->stream_attributes.out_media_config, PAL_STREAM_DEEP_BUFFER);
+            }
         } else {
-            udata->stream_attributes->flags  = PAL_STREAM_FLAG_NON_BLOCKING_MASK; /* required in PAL as this a non-blocking call*/
-            udata->stream_attributes->out_media_config.sample_rate = 44100 ;
-            udata->stream_attributes->out_media_config.ch_info.channels = 2;
-            udata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_COMPRESSED;
+            udata->stream_attributes.flags  = PAL_STREAM_FLAG_NON_BLOCKING_MASK; /* required in PAL as this a non-blocking call*/
+            udata->stream_attributes.out_media_config.sample_rate = 44100 ;
+            udata->stream_attributes.out_media_config.ch_info.channels = 2;
+            udata->stream_attributes.out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_COMPRESSED;
             udata->sink_buf_size = 16484;
         }
     } else {
-        udata->stream_attributes->direction = PAL_AUDIO_INPUT;
-        udata->stream_attributes->in_media_config.sample_rate = udata->info.rate;
-        udata->stream_attributes->in_media_config.bit_width = 16;
+        udata->stream_attributes.direction = PAL_AUDIO_INPUT;
+        udata->stream_attributes.in_media_config.sample_rate = udata->info.rate;
+        udata->stream_attributes.in_media_config.bit_width = 16;
 
-        switch (udata->stream_attributes->in_media_config.bit_width) {
+        switch (udata->stream_attributes.in_media_config.bit_width) {
             case 32:
-                udata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
+                udata->stream_attributes.in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
                 break;
             case 24:
-                udata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
+                udata->stream_attributes.in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
                 break;
             default:
-                udata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
+                udata->stream_attributes.in_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
                 break;
         }
 
-        udata->stream_attributes->in_media_config.ch_info.channels = udata->info.channels;
-        udata->stream_attributes->in_media_config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
-        udata->stream_attributes->in_media_config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+        udata->stream_attributes.in_media_config.ch_info.channels = udata->info.channels;
+        udata->stream_attributes.in_media_config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
+        udata->stream_attributes.in_media_config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
         udata->source_buf_size = 512;
         udata->source_buf_count = 8;
     }
 
-    udata->pal_device = calloc(udata->no_of_devices, sizeof(struct pal_device));
-    memset(udata->pal_device, 0, udata->no_of_devices * sizeof(struct pal_device));
+    spa_zero(udata->pal_device);
 
     for(int i = 0; i < udata->no_of_devices; i++) {
         udata->pal_device[i].id = udata->pal_device_id[i];
@@ -614,8 +4236,227 @@ static void pw_pal_fill_stream_info(struct pw_userdata *udata)
     }
 }
 
+static void pw_pal_duplex_fill_stream_info(struct pw_userdata *udata)
+{
+    struct pw_pal_duplex *tx = &udata->tx;
+    struct pal_media_config *config = &tx->attributes.in_media_config;
+
+    spa_zero(tx->attributes);
+    tx->attributes.type = PAL_STREAM_VOIP_TX;
+    tx->attributes.direction = PAL_AUDIO_INPUT;
+    tx->attributes.info.opt_stream_info.version = 1;
+    tx->attributes.info.opt_stream_info.duration_us = -1;
+
+    config->sample_rate = udata->info.rate;
+    config->bit_width = 16;
+    config->aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
+    config->ch_info.channels = udata->info.channels;
+    config->ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
+    config->ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+
+    spa_zero(tx->device);
+    tx->device.id = udata->pal_device_id[0] == PAL_DEVICE_OUT_WIRED_HEADSET ?
+        PAL_DEVICE_IN_WIRED_HEADSET : PAL_DEVICE_IN_SPEAKER_MIC;
+    tx->device.config.sample_rate = 48000;
+    tx->device.config.bit_width = 16;
+    tx->device.config.ch_info.channels = 2;
+    tx->device.config.ch_info.ch_map[0] = PAL_CHMAP_CHANNEL_FL;
+    tx->device.config.ch_info.ch_map[1] = PAL_CHMAP_CHANNEL_FR;
+
+    tx->buf_size = pw_stream_get_buffer_size(udata, *config, PAL_STREAM_VOIP_TX);
+    tx->buf_count = 4;
+}
+
+static int pw_pal_pool_init(struct pw_userdata *udata)
+{
+    struct pw_pal_fragment_pool *pool = &udata->offload.pool;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (!pw_properties_get_bool(udata->stream_props, "compress.power-mode", false))
+        return 0;
+
+    pool->size = pw_properties_get_uint32(udata->stream_props, "compress.fragment-size",
+            PW_DEFAULT_FRAGMENT_SIZE);
+    pool->size = SPA_CLAMP(pool->size, (uint32_t)udata->sink_buf_size, PW_MAX_FRAGMENT_SIZE);
+    pool->size = SPA_ROUND_UP_N(pool->size, (uint32_t)page_size);
+    pool->count = pw_properties_get_uint32(udata->stream_props, "compress.fragment-count",
+            PW_DEFAULT_FRAGMENT_COUNT);
+    pool->count = SPA_CLAMP(pool->count, 2u, PW_MAX_FRAGMENTS);
+
+    /* the fragments are allocated with the scratch arena */
+    pw_log_info("compress power mode: %u fragments of %u bytes", pool->count, pool->size);
+    return 0;
+}
+
+/* One page aligned, prefaulted and locked block for the fragment pool, the
+ * pre-roll buffers and the capture ring, sized by pw_pal_pool_init(),
+ * pw_pal_silence_init(), pw_pal_prime_init() and pw_pal_fanout_init(). The
+ * pool comes first and is a multiple of the page size. */
+static int pw_pal_arena_init(struct pw_userdata *udata)
+{
+    struct pw_pal_arena *arena = &udata->arena;
+    struct pw_pal_fragment_pool *pool = &udata->offload.pool;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t pool_size = (size_t)pool->size * pool->count;
+    size_t preroll_size = SPA_ROUND_UP_N((size_t)udata->silence.preroll_size, PW_PAL_BUFFER_ALIGN);
+    size_t prime_size = SPA_ROUND_UP_N((size_t)udata->prime.size, PW_PAL_BUFFER_ALIGN);
+    size_t ring_size = udata->fanout.size;
+    void *mem;
+    int res;
+
+    if (pool_size + preroll_size + prime_size + ring_size == 0)
+        return 0;
+
+    arena->size = SPA_ROUND_UP_N(pool_size + preroll_size + prime_size + ring_size, page_size);
+    if ((res = posix_memalign(&mem, page_size, arena->size)) != 0) {
+        pw_log_error("can't allocate %zu bytes of scratch memory", arena->size);
+        arena->size = 0;
+        return -res;
+    }
+    arena->mem = mem;
+    /* private, so it can be written to fault in what mlock() can't */
+    memset(arena->mem, 0, arena->size);
+    arena->locked = pw_pal_lock_memory(udata, arena->mem, arena->size);
+
+    if (pool_size)
+        pool->mem = arena->mem;
+    if (preroll_size)
+        udata->silence.preroll = arena->mem + pool_size;
+    if (prime_size)
+        udata->prime.buf = arena->mem + pool_size + preroll_size;
+    if (ring_size)
+        udata->fanout.ring = arena->mem + pool_size + preroll_size + prime_size;
+    return 0;
+}
+
+static int pw_pal_silence_init(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct pw_pal_silence *silence = &udata->silence;
+    uint32_t hold_ms, preroll_ms, buf_size;
+
+    hold_ms = pw_properties_get_uint32(props, "pal.silence.hold-ms", 0);
+    if (hold_ms == 0)
+        return 0;
+
+    /* sized by the smallest session the node may restart */
+    buf_size = udata->latency.enabled ?
+        SPA_MIN(udata->latency.ll_buf_size, udata->latency.db_buf_size) : udata->sink_buf_size;
+    silence->preroll_size = buf_size * udata->sink_buf_count;
+    silence->preroll_hold = silence->preroll_size - buf_size;
+
+    /* at most half of what is held is the silent lead */
+    preroll_ms = pw_properties_get_uint32(props, "pal.silence.preroll-ms",
+            PW_DEFAULT_SILENCE_PREROLL_MS);
+    silence->preroll_lead = SPA_MIN((uint64_t)udata->info.rate * preroll_ms / SPA_MSEC_PER_SEC,
+            (uint64_t)silence->preroll_hold / 2 / udata->frame_size) * udata->frame_size;
+
+    silence->event = pw_loop_add_event(pw_context_get_main_loop(udata->context),
+            pw_pal_silence_event, udata);
+    if (silence->event == NULL)
+        return -errno;
+
+    silence->hold_ns = hold_ms * SPA_NSEC_PER_MSEC;
+    pw_log_info("standby after %u ms of silence, %u ms pre-roll", hold_ms,
+            (uint32_t)((uint64_t)silence->preroll_lead * SPA_MSEC_PER_SEC /
+            ((uint64_t)udata->frame_size * udata->info.rate)));
+    return 0;
+}
+
+static int pw_pal_prime_init(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct pw_pal_prime *prime = &udata->prime;
+    size_t period = udata->sink_buf_size;
+
+    prime->periods = pw_properties_get_uint32(props, "pal.start.preroll-periods", 0);
+    if (prime->periods == 0)
+        return 0;
+    /* more than PAL buffers would block the write ahead of the start */
+    if (prime->periods > udata->sink_buf_count) {
+        pw_log_warn("pal.start.preroll-periods limited to %zu", udata->sink_buf_count);
+        prime->periods = udata->sink_buf_count;
+    }
+    if (udata->latency.enabled)
+        period = SPA_MAX(udata->latency.ll_buf_size, udata->latency.db_buf_size);
+    /* plus a couple of graph cycles that arrive while the session starts */
+    prime->size = prime->periods * period + 2 * PW_GRAPH_DEFAULT_QUANTUM * udata->frame_size;
+
+    prime->event = pw_loop_add_event(pw_context_get_main_loop(udata->context),
+            pw_pal_prime_event, udata);
+    if (prime->event == NULL)
+        return -errno;
+
+    pw_log_info("priming %u periods before the start", prime->periods);
+    return 0;
+}
+
+/* pal.capture.taps = [ { node.name = ... node.latency = ... } ... ], each
+ * entry adds a source node on top of the module's stream properties. */
+static int pw_pal_fanout_init(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct pw_pal_fanout *fanout = &udata->fanout;
+    struct pw_pal_tap *tap;
+    struct spa_json it[2];
+    const char *str, *val, *name;
+    uint32_t periods;
+    int len;
+
+    if ((str = pw_properties_get(props, "pal.capture.taps")) == NULL)
+        return 0;
+
+    spa_json_init(&it[0], str, strlen(str));
+    if (spa_json_enter_array(&it[0], &it[1]) <= 0) {
+        pw_log_error("pal.capture.taps must be an array of objects");
+        return -EINVAL;
+    }
+
+    name = pw_properties_get(udata->stream_props, PW_KEY_NODE_NAME);
+    fanout->taps[0].udata = udata;
+    fanout->n_taps = 1;
+    while ((len = spa_json_next(&it[1], &val)) > 0) {
+        if (!spa_json_is_object(val, len)) {
+            pw_log_error("pal.capture.taps must be an array of objects");
+            return -EINVAL;
+        }
+        if ((len = spa_json_container_len(&it[1], val, len)) <= 0)
+            return -EINVAL;
+        if (fanout->n_taps > PW_PAL_MAX_TAPS) {
+            pw_log_warn("ignoring capture taps after the first %d", PW_PAL_MAX_TAPS);
+            break;
+        }
+        tap = &fanout->taps[fanout->n_taps];
+        tap->udata = udata;
+        tap->props = pw_properties_copy(udata->stream_props);
+        if (tap->props == NULL)
+            return -errno;
+        pw_properties_setf(tap->props, PW_KEY_NODE_NAME, "%s.tap%u", name, fanout->n_taps);
+        pw_properties_setf(tap->props, PW_KEY_NODE_DESCRIPTION, "%s (tap %u)",
+                name, fanout->n_taps);
+        pw_properties_update_string(tap->props, val, len);
+        fanout->n_taps++;
+    }
+    if (fanout->n_taps == 1)
+        return 0;
+
+    /* enough periods for two default quanta per consumer plus the one
+     * being read */
+    fanout->period = udata->source_buf_size;
+    periods = 4 * PW_GRAPH_DEFAULT_QUANTUM * udata->frame_size / fanout->period + 1;
+    fanout->size = fanout->period * SPA_MAX(periods, (uint32_t)PW_PAL_FANOUT_PERIODS);
+
+    fanout->reap_event = pw_loop_add_event(pw_context_get_main_loop(udata->context),
+            pw_pal_tap_reap, udata);
+    if (fanout->reap_event == NULL)
+        return -errno;
+    fanout->enabled = true;
+    pw_log_info("%u capture consumers share one PAL session, %u byte ring",
+            fanout->n_taps, fanout->size);
+    return 0;
+}
+
 static inline bool pw_stream_is_running(struct pw_userdata *udata)
 {
+    if (udata != NULL && udata->use_node)
+        return udata->node.started;
     if (udata == NULL || udata->stream == NULL)
         return false;
 
@@ -630,12 +4471,219 @@ static inline bool pw_stream_is_running(struct pw_userdata *udata)
     return st == PW_STREAM_STATE_STREAMING;
 }
 
+/* Main thread: whether the node would have its PAL session open now. */
+static bool pw_pal_ssr_wants_session(struct pw_userdata *udata)
+{
+    if (udata->is_loopback)
+        return udata->loopback.enabled;
+    if (udata->is_duplex && udata->tx.stream &&
+        pw_stream_get_state(udata->tx.stream, NULL) == PW_STREAM_STATE_STREAMING)
+        return true;
+    if (udata->fanout.enabled)
+        return udata->fanout.active > 0;
+    return pw_stream_is_running(udata);
+}
+
+static void pw_pal_ssr_set_retry(struct pw_userdata *udata, bool retry)
+{
+    struct pw_pal_ssr *ssr = &udata->ssr;
+    struct timespec interval;
+
+    if (ssr->retrying == retry)
+        return;
+    ssr->retrying = retry;
+    interval.tv_sec = ssr->retry_ms / SPA_MSEC_PER_SEC;
+    interval.tv_nsec = (ssr->retry_ms % SPA_MSEC_PER_SEC) * SPA_NSEC_PER_MSEC;
+    pw_loop_update_timer(pw_context_get_main_loop(udata->context), ssr->retry_timer,
+            retry ? &interval : NULL, retry ? &interval : NULL, false);
+}
+
+/* Main thread: open the sessions again the same way a graph start would,
+ * with the device, volume and buffer setup the node has now. */
+static void pw_pal_ssr_reopen(struct pw_userdata *udata)
+{
+    struct pw_pal_ssr *ssr = &udata->ssr;
+
+    /* the graph may have restarted the session on its own meanwhile */
+    if (pw_pal_ssr_wants_session(udata) && udata->stream_handle == NULL) {
+        if (udata->is_duplex)
+            pw_pal_duplex_start(udata);
+        else
+            pw_pal_stream_start(udata);
+        if (udata->stream_handle == NULL)
+            return;
+    }
+
+    ssr->recovery_ns = pw_pal_get_time_ns() - ssr->offline_ns;
+    ssr->recoveries++;
+    pw_log_info("%s: recovered from DSP restart in %" PRIu64 " ms",
+            pw_properties_get(udata->stream_props, PW_KEY_NODE_NAME),
+            (uint64_t)(ssr->recovery_ns / SPA_NSEC_PER_MSEC));
+    pw_pal_ssr_set_retry(udata, false);
+    SPA_ATOMIC_STORE(ssr->state, PW_PAL_SSR_ONLINE);
+}
+
+/* Main thread: signalled by the data thread and the PAL callback, and
+ * polled from the retry timer until the sessions are back. */
+static void pw_pal_ssr_event(void *data, uint64_t count)
+{
+    struct pw_userdata *udata = data;
+    struct pw_pal_ssr *ssr = &udata->ssr;
+    int state = SPA_ATOMIC_LOAD(ssr->state);
+
+    if (state == PW_PAL_SSR_ONLINE)
+        return;
+    pw_pal_ssr_set_retry(udata, true);
+
+    /* a running data thread lets go of the handles first */
+    if (state == PW_PAL_SSR_OFFLINE && udata->stream_handle &&
+        !udata->is_loopback && pw_pal_ssr_wants_session(udata))
+        return;
+
+    if (state != PW_PAL_SSR_CLOSED) {
+        /* nothing is left to drain on a dead DSP */
+        SPA_ATOMIC_STORE(udata->offload.state, PW_PAL_OFFLOAD_DRAINED);
+        if (udata->is_duplex)
+            pw_pal_duplex_close(udata);
+        else
+            close_pal_stream(udata);
+        SPA_ATOMIC_STORE(ssr->state, PW_PAL_SSR_CLOSED);
+    }
+
+    if (!SPA_ATOMIC_LOAD(ssr->card_offline))
+        pw_pal_ssr_reopen(udata);
+}
+
+static void pw_pal_ssr_retry(void *data, uint64_t expirations)
+{
+    pw_pal_ssr_event(data, expirations);
+}
+
+/* PAL callback thread: sound card state, offline for the duration of a
+ * DSP restart. */
+static int32_t pw_pal_ssr_global_cb(uint32_t event_id, uint32_t *event_data, uint64_t cookie)
+{
+    struct pw_userdata *udata;
+    bool offline;
+
+    if (event_id != PAL_SND_CARD_STATE || event_data == NULL)
+        return 0;
+    offline = *event_data == CARD_STATUS_OFFLINE;
+
+    pthread_mutex_lock(&pw_pal_ssr_lock);
+    spa_list_for_each(udata, &pw_pal_ssr_nodes, ssr.link) {
+        SPA_ATOMIC_STORE(udata->ssr.card_offline, offline);
+        if (offline)
+            pw_pal_ssr_offline(udata, PW_PAL_SSR_OFFLINE);
+        else
+            pw_loop_signal_event(pw_context_get_main_loop(udata->context), udata->ssr.event);
+    }
+    pthread_mutex_unlock(&pw_pal_ssr_lock);
+    return 0;
+}
+
+static int pw_pal_ssr_init(struct pw_userdata *udata, const struct pw_properties *props)
+{
+    struct pw_loop *loop = pw_context_get_main_loop(udata->context);
+    struct pw_pal_ssr *ssr = &udata->ssr;
+    int rc;
+
+    ssr->retry_ms = pw_properties_get_uint32(props, "pal.ssr.retry-ms", PW_DEFAULT_SSR_RETRY_MS);
+    if (ssr->retry_ms == 0)
+        ssr->retry_ms = PW_DEFAULT_SSR_RETRY_MS;
+#ifdef PW_PAL_FAULT_INJECTION
+    ssr->fault_after = pw_properties_get_uint32(props, "pal.ssr.fault-after", 0);
+#else
+    if (pw_properties_get(props, "pal.ssr.fault-after") != NULL)
+        pw_log_warn("pal.ssr.fault-after needs a build with --enable-fault-injection");
+#endif
+
+    ssr->event = pw_loop_add_event(loop, pw_pal_ssr_event, udata);
+    if (ssr->event == NULL)
+        return -errno;
+    ssr->retry_timer = pw_loop_add_timer(loop, pw_pal_ssr_retry, udata);
+    if (ssr->retry_timer == NULL)
+        return -errno;
+
+    pthread_mutex_lock(&pw_pal_ssr_lock);
+    if (!pw_pal_ssr_registered) {
+        if ((rc = pal_register_global_callback(pw_pal_ssr_global_cb, 0)) == 0)
+            pw_pal_ssr_registered = true;
+        else
+            pw_log_warn("no sound card state events (error %d), relying on I/O errors", rc);
+    }
+    spa_list_append(&pw_pal_ssr_nodes, &ssr->link);
+    pthread_mutex_unlock(&pw_pal_ssr_lock);
+
+#ifdef PW_PAL_FAULT_INJECTION
+    if (ssr->fault_after)
+        pw_log_warn("faking a DSP restart every %u PAL transfers", ssr->fault_after);
+#endif
+    return 0;
+}
+
+/* Main thread: add or remove the devices behind the jack from the running
+ * session without reopening it. */
+static int pw_pal_combined_jack(struct pw_userdata *udata, bool connected)
+{
+    struct pw_pal_combined *combined = &udata->combined;
+    pal_param_device_connection_t device_connection;
+    uint32_t i, present = combined->present;
+    int ret = 0;
+
+    for (i = 0; i < combined->n_devices; i++) {
+        if (!pw_pal_device_behind_jack(udata->jack_name, combined->devices[i]))
+            continue;
+        if (connected)
+            present |= 1u << i;
+        else
+            present &= ~(1u << i);
+        /* display outputs are only routable once PAL knows they are there */
+        if (strstr(udata->jack_name, "DP")) {
+            spa_zero(device_connection);
+            device_connection.connection_state = connected;
+            device_connection.id = combined->devices[i];
+            if ((ret = pal_set_param(PAL_PARAM_ID_DEVICE_CONNECTION, &device_connection,
+                    sizeof(pal_param_device_connection_t))))
+                pw_log_error("%s: device connection of %d failed: %d", __func__,
+                        combined->devices[i], ret);
+        }
+    }
+    if (present == combined->present)
+        return 0;
+    combined->present = present;
+    pw_pal_combined_build(udata);
+    pw_pal_update_device_latency(udata);
+
+    /* sessions opened later, e.g. after a DSP restart, use the new list */
+    if (udata->stream_handle == NULL || SPA_ATOMIC_LOAD(udata->ssr.state) != PW_PAL_SSR_ONLINE)
+        return 0;
+
+    ret = pal_stream_set_device(udata->stream_handle, udata->no_of_devices, udata->pal_device);
+    if (ret) {
+        pw_log_error("%s: pal_stream_set_device with %u devices failed: %d", __func__,
+                udata->no_of_devices, ret);
+        return ret;
+    }
+    if (udata->latency.enabled && udata->latency.next &&
+        SPA_ATOMIC_LOAD(udata->latency.stage) != PW_PAL_LATENCY_IDLE &&
+        (ret = pal_stream_set_device(udata->latency.next, udata->no_of_devices, udata->pal_device)))
+        pw_log_error("%s: pal_stream_set_device failed for new session: %d", __func__, ret);
+
+    combined->reroutes++;
+    pw_log_info("%s: now rendering to %u devices", udata->jack_name, udata->no_of_devices);
+    return ret;
+}
+
 static int handle_device_connection(struct pw_userdata *udata, bool state)
 {
     int ret = 0;
     struct pal_device dev;
+    pal_param_device_connection_t device_connection;
     if (!udata) return -EINVAL;
 
+    if (udata->combined.enabled)
+        return pw_pal_combined_jack(udata, state);
     if (udata->no_of_devices != 1) {
         pw_log_info("%s: combined playback selected, skip routing for jack '%s'",
             __func__, udata->jack_name);
@@ -645,26 +4693,30 @@ static int handle_device_connection(struct pw_userdata *udata, bool state)
     pw_log_info("%s: processing device connection for jack '%s'", __func__, udata->jack_name);
 
     if (strstr(udata->jack_name, "DP")) {
-        pal_param_device_connection_t *device_connection = (pal_param_device_connection_t *)
-            calloc(1, sizeof(pal_param_device_connection_t));
-        device_connection->connection_state = state;
-        device_connection->id = udata->pal_device_id[0];
-        ret = pal_set_param (PAL_PARAM_ID_DEVICE_CONNECTION, device_connection,
+        spa_zero(device_connection);
+        device_connection.connection_state = state;
+        device_connection.id = udata->pal_device_id[0];
+        return pal_set_param (PAL_PARAM_ID_DEVICE_CONNECTION, &device_connection,
                 sizeof(pal_param_device_connection_t));
-        free(device_connection);
-        return ret;
     }
     else if (strstr(udata->jack_name, "Headset")) {
+        const pal_device_id_t target = udata->isplayback
+            ? (state ? PAL_DEVICE_OUT_WIRED_HEADSET : PAL_DEVICE_OUT_SPEAKER)
+            : (state ? PAL_DEVICE_IN_WIRED_HEADSET  : PAL_DEVICE_IN_SPEAKER_MIC);
+
+        /* the sessions reopened after a DSP restart pick up the route */
+        if (SPA_ATOMIC_LOAD(udata->ssr.state) != PW_PAL_SSR_ONLINE) {
+            udata->pal_device[0].id = target;
+            if (udata->is_duplex)
+                udata->tx.device.id = state ? PAL_DEVICE_IN_WIRED_HEADSET : PAL_DEVICE_IN_SPEAKER_MIC;
+            return 0;
+        }
 
         if (!pw_stream_is_running(udata) || !udata->stream_handle) {
             pw_log_error("%s: stream not streaming; skip headset routing", __func__);
             return 0;
         }
 
-        const pal_device_id_t target = udata->isplayback
-            ? (state ? PAL_DEVICE_OUT_WIRED_HEADSET : PAL_DEVICE_OUT_SPEAKER)
-            : (state ? PAL_DEVICE_IN_WIRED_HEADSET  : PAL_DEVICE_IN_SPEAKER_MIC);
-
         memset(&dev, 0, sizeof(dev));
         dev.id = target;
 
@@ -673,8 +4725,25 @@ static int handle_device_connection(struct pw_userdata *udata, bool state)
             pw_log_error("%s: pal_stream_set_device(%d) failed: %d", __func__, target, ret);
             return ret;
         }
-        return 0;
+        /* sessions opened later, e.g. by a latency switch, follow the route */
+        udata->pal_device[0].id = target;
+        pw_pal_update_device_latency(udata);
+        if (udata->latency.enabled && udata->latency.next &&
+            SPA_ATOMIC_LOAD(udata->latency.stage) != PW_PAL_LATENCY_IDLE &&
+            (ret = pal_stream_set_device(udata->latency.next, 1, &dev)))
+            pw_log_error("%s: pal_stream_set_device(%d) failed for new session: %d",
+                    __func__, target, ret);
+
+        if (udata->is_duplex && udata->tx.handle) {
+            udata->tx.device.id = state ? PAL_DEVICE_IN_WIRED_HEADSET : PAL_DEVICE_IN_SPEAKER_MIC;
+            ret = pal_stream_set_device(udata->tx.handle, 1, &udata->tx.device);
+            if (ret)
+                pw_log_error("%s: voip tx pal_stream_set_device(%d) failed: %d", __func__,
+                        udata->tx.device.id, ret);
+        }
+        return ret;
     }
+    return 0;
 }
 
 
@@ -690,6 +4759,9 @@ static void handle_jack_boot_event(struct pw_userdata *udata)
         // Check for HDMI/DP jack state
         if (BIT_VALUE(SW_LINEOUT_INSERT, sw_bitmask))
             connected = 1;
+        /* a combined sink only renders to the headset once it is plugged */
+        if (udata->combined.enabled && BIT_VALUE(SW_HEADPHONE_INSERT, sw_bitmask))
+            connected = 1;
 
         if (connected) {
             pw_log_info("%s: Connected (boot time)", udata->jack_name);
@@ -715,13 +4787,10 @@ static void on_jack_event(void *userdata, int fd, uint32_t mask)
 
     if (mask & (SPA_IO_ERR | SPA_IO_HUP)) {
         pw_log_error("error or hang-up on the hdmi/dp fd");
+        /* destroying the source also closes jack_fd */
         pw_loop_destroy_source(pw_context_get_main_loop(udata->context), udata->jack_src);
         udata->jack_src = NULL;
-
-        if (udata->jack_fd >= 0) {
-            close(udata->jack_fd);
-            udata->jack_fd = -1;
-        }
+        udata->jack_fd = -1;
         return;
     }
 
@@ -735,7 +4804,9 @@ static void on_jack_event(void *userdata, int fd, uint32_t mask)
             const char *state = ev.value ? "Connected" : "Disconnected";
             pw_log_info("Jack (%s): %s", udata->jack_name, state);
 
-            if (handle_device_connection(udata, ev.value ? true : false))
+            rc = handle_device_connection(udata, ev.value ? true : false);
+            PW_PAL_TRACE(jack, udata->node_id, ev.code, ev.value, rc);
+            if (rc)
                 pw_log_error("Failed to handle %s device connection",udata->jack_name);
         }
     } else if (ret < 0) {
@@ -767,7 +4838,7 @@ static int jack_open_fd(struct pw_userdata *udata)
         char filepath[512];
         snprintf(filepath, sizeof(filepath), "%s/%s",
             DEV_INPUT_DIR, dir->d_name);
-        int fd = open(filepath, O_RDONLY);
+        int fd = open(filepath, O_RDONLY | O_CLOEXEC);
         if (fd < 0) {
             pw_log_error("open() failed %s", filepath);
             continue;
@@ -797,6 +4868,7 @@ static int jack_register(struct pw_userdata *udata)
     int ret = 0;
     udata->jack_fd = jack_open_fd(udata);
     if (udata->jack_fd < 0) {
+        udata->jack_fd = -1;
         ret = -EBADFD;
         goto exit;
     }
@@ -829,6 +4901,7 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
     uint32_t pid = getpid();
     struct pw_userdata *udata;
     const char *str, *value, *role;
+    pthread_condattr_t cattr;
     int res = 0;
 
     PW_LOG_TOPIC_INIT(log_topic);
@@ -836,6 +4909,9 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
     udata = calloc(1, sizeof(struct pw_userdata));
     if (udata == NULL)
         return -errno;
+    udata->jack_fd = -1;
+    udata->node_id = SPA_ID_INVALID;
+    udata->tx.node_id = SPA_ID_INVALID;
     if (args == NULL)
         args = "";
 
@@ -899,18 +4975,55 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
             udata->pal_device_id[0] = PAL_DEVICE_OUT_AUX_DIGITAL;
         else if (strstr(value, "pal_sink_hdmi_out"))
             udata->pal_device_id[0] = PAL_DEVICE_OUT_HDMI;
-        else if (strstr(value, "pal_sink_combined")) {
-            udata->pal_device_id[0] = PAL_DEVICE_OUT_WIRED_HEADSET;
-            udata->pal_device_id[1] = PAL_DEVICE_OUT_SPEAKER;
-            udata->no_of_devices = 2;
-        }
     }
+    if ((str = pw_properties_get(props, "devices")) != NULL) {
+        if ((res = pw_pal_parse_devices(str, udata->pal_device_id, MAX_DEVICES)) < 0)
+            goto error;
+        if (res > 0)
+            udata->no_of_devices = res;
+        res = 0;
+    }
+    pw_pal_parse_device_latency(udata, props);
 
     if (pw_properties_get(props, PW_KEY_MEDIA_ROLE) == NULL)
         pw_properties_set(props, PW_KEY_MEDIA_ROLE, "notification");
 
     role = pw_properties_get(props, PW_KEY_MEDIA_ROLE);
-    if (role && (udata->isplayback)) {
+    udata->is_duplex = udata->isplayback && pw_properties_get_bool(props, "pal.voip", false);
+    udata->is_loopback = pw_properties_get_bool(props, "pal.loopback", false);
+    if (udata->is_loopback) {
+        /* pal_device[0] is the sink, pal_device[1] the source of the loopback */
+        udata->isplayback = true;
+        udata->stream_type = PAL_STREAM_LOOPBACK;
+        udata->no_of_devices = 2;
+        udata->pal_device_id[0] = PAL_DEVICE_OUT_WIRED_HEADSET;
+        udata->pal_device_id[1] = PAL_DEVICE_IN_WIRED_HEADSET;
+        if ((str = pw_properties_get(props, "loopback.output")) != NULL &&
+            (udata->pal_device_id[0] = pw_pal_device_from_name(str)) == PAL_DEVICE_NONE) {
+            res = -EINVAL;
+            pw_log_error("unknown loopback.output device '%s'", str);
+            goto error;
+        }
+        if ((str = pw_properties_get(props, "loopback.input")) != NULL &&
+            (udata->pal_device_id[1] = pw_pal_device_from_name(str)) == PAL_DEVICE_NONE) {
+            res = -EINVAL;
+            pw_log_error("unknown loopback.input device '%s'", str);
+            goto error;
+        }
+        udata->loopback.enabled = pw_properties_get_bool(props, "loopback.enabled", false);
+        udata->loopback.gain = 1.0f;
+        if ((str = pw_properties_get(props, "loopback.gain")) != NULL)
+            udata->loopback.gain = SPA_CLAMP(strtof(str, NULL), 0.0f, 1.0f);
+    } else if (udata->is_duplex) {
+        udata->stream_type = PAL_STREAM_VOIP_RX;
+    } else if (udata->isplayback && pw_properties_get_bool(props, "pal.latency-switch", false)) {
+        /* media.role is ignored, the quantum picks the session type */
+        udata->latency.enabled = true;
+        udata->latency.quantum_limit = pw_properties_get_uint32(props,
+                "pal.latency-switch.quantum", PW_DEFAULT_LL_QUANTUM_LIMIT);
+        udata->latency.current = PAL_STREAM_DEEP_BUFFER;
+        udata->stream_type = PAL_STREAM_DEEP_BUFFER;
+    } else if (role && (udata->isplayback)) {
         if (strstr(role, "music"))
             udata->stream_type = PAL_STREAM_DEEP_BUFFER;
         else
@@ -941,9 +5054,58 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
     pw_pal_set_props(udata, props, PW_KEY_NODE_DESCRIPTION);
     pw_pal_set_props(udata, props, PW_KEY_NODE_GROUP);
     pw_pal_set_props(udata, props, PW_KEY_NODE_LATENCY);
+    pw_pal_set_props(udata, props, PW_KEY_NODE_LOOP_NAME);
+    pw_pal_set_props(udata, props, PW_KEY_NODE_LOOP_CLASS);
     pw_pal_set_props(udata, props, PW_KEY_NODE_VIRTUAL);
     pw_pal_set_props(udata, props, PW_KEY_MEDIA_CLASS);
 
+    if ((str = pw_properties_get(props, "pal.node.mode")) != NULL && spa_streq(str, "spa")) {
+        if (udata->is_offload || udata->is_duplex || udata->is_loopback ||
+            pw_properties_get(props, "pal.capture.taps") != NULL)
+            pw_log_warn("pal.node.mode = spa only supports PCM sinks and sources "
+                    "without taps, using a stream");
+        else
+            udata->use_node = true;
+    }
+    if (udata->use_node) {
+        /* without a clock slaved to the DSP the node must not drive */
+        if (pw_properties_get_bool(udata->stream_props, PW_KEY_NODE_DRIVER, false))
+            pw_log_warn("%s is not supported with pal.node.mode = spa, ignoring it",
+                    PW_KEY_NODE_DRIVER);
+        pw_properties_set(udata->stream_props, PW_KEY_NODE_DRIVER, "false");
+        pw_properties_set(udata->stream_props, "node.want-driver", "true");
+    }
+
+    if (udata->is_duplex) {
+        /* the TX node inherits the format and gets its names from source.props */
+        udata->tx.props = pw_properties_new(NULL, NULL);
+        if (udata->tx.props == NULL) {
+            res = -errno;
+            pw_log_error( "can't create properties: %m");
+            goto error;
+        }
+        if ((str = pw_properties_get(props, "source.props")) != NULL)
+            pw_properties_update_string(udata->tx.props, str, strlen(str));
+        if (pw_properties_get(udata->stream_props, PW_KEY_NODE_GROUP) == NULL)
+            pw_properties_setf(udata->stream_props, PW_KEY_NODE_GROUP, "pal-voip-%u", id);
+        if (pw_properties_get(udata->tx.props, PW_KEY_NODE_NAME) == NULL)
+            pw_properties_setf(udata->tx.props, PW_KEY_NODE_NAME, "%s_tx",
+                    pw_properties_get(props, PW_KEY_NODE_NAME));
+        if (pw_properties_get(udata->tx.props, PW_KEY_NODE_DESCRIPTION) == NULL)
+            pw_properties_set(udata->tx.props, PW_KEY_NODE_DESCRIPTION,
+                    pw_properties_get(udata->tx.props, PW_KEY_NODE_NAME));
+        pw_properties_set(udata->tx.props, PW_KEY_MEDIA_CLASS, "Audio/Source");
+        pw_properties_set(udata->tx.props, PW_KEY_NODE_GROUP,
+                pw_properties_get(udata->stream_props, PW_KEY_NODE_GROUP));
+        if ((str = pw_properties_get(udata->stream_props, SPA_KEY_AUDIO_POSITION)) != NULL)
+            pw_properties_set(udata->tx.props, SPA_KEY_AUDIO_POSITION, str);
+        pw_properties_set(udata->tx.props, PW_KEY_NODE_VIRTUAL, "true");
+    }
+
+    pw_pal_parse_thread_sched(udata, props);
+    udata->stats_interval_ms = pw_properties_get_uint32(props, "pal.stats.interval-ms",
+            PW_DEFAULT_STATS_INTERVAL_MS);
+
     pw_pal_fetch_audio_info(udata->stream_props, &udata->info);
     if (!udata->is_offload) {
         udata->frame_size = pw_pal_get_frame_size(&udata->info);
@@ -953,12 +5115,46 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
             goto error;
         }
     } else {
+        udata->latency.enabled = false;
         udata->stream_type = PAL_STREAM_COMPRESSED;
         udata->frame_size = 16;
+        udata->offload.next_gapless = (uint64_t)pw_properties_get_uint32(udata->stream_props,
+            "codec.encoder-delay", 0) << 32 | pw_properties_get_uint32(udata->stream_props,
+            "codec.encoder-padding", 0);
+        udata->offload.drain_timeout_ms = pw_properties_get_uint32(udata->stream_props,
+            "compress.drain-timeout-ms", PW_DEFAULT_DRAIN_TIMEOUT_MS);
+        pthread_mutex_init(&udata->offload.lock, NULL);
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&udata->offload.cond, &cattr);
+        pthread_condattr_destroy(&cattr);
+        udata->offload.drain_event = pw_loop_add_event(pw_context_get_main_loop(context),
+            pw_pal_offload_drain_done, udata);
+        udata->offload.drain_timer = pw_loop_add_timer(pw_context_get_main_loop(context),
+            pw_pal_offload_drain_timeout, udata);
+        udata->offload.idle_event = pw_loop_add_event(pw_context_get_main_loop(context),
+            pw_pal_offload_idle_event, udata);
+        if (udata->offload.drain_event == NULL || udata->offload.drain_timer == NULL ||
+            udata->offload.idle_event == NULL) {
+            res = -errno;
+            pw_log_error("can't create drain event: %m");
+            goto error;
+        }
         pw_properties_set(udata->stream_props, PW_KEY_MEDIA_CLASS, "Audio/Sink");
         pw_properties_set(udata->stream_props, PW_KEY_AUDIO_FORMAT, "encoded");
         pw_properties_set(udata->stream_props, "audio.coding.format", "mp3");
     }
+    if (udata->latency.enabled) {
+        udata->latency.event = pw_loop_add_event(pw_context_get_main_loop(context),
+            pw_pal_latency_event, udata);
+        udata->latency.playout_timer = pw_loop_add_timer(pw_context_get_main_loop(context),
+            pw_pal_latency_finish, udata);
+        if (udata->latency.event == NULL || udata->latency.playout_timer == NULL) {
+            res = -errno;
+            pw_log_error("can't create latency switch sources: %m");
+            goto error;
+        }
+    }
     udata->core = pw_context_get_object(udata->context, PW_TYPE_INTERFACE_Core);
     if (udata->core == NULL) {
         str = pw_properties_get(props, PW_KEY_REMOTE_NAME);
@@ -983,9 +5179,46 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
             &udata->core_listener,
             &pw_pal_events_core, udata);
     pw_pal_fill_stream_info(udata);
-    if ((res = pw_pal_create_stream(udata)) < 0)
+    if (udata->isplayback && !udata->is_loopback && udata->no_of_devices > 1)
+        pw_pal_combined_init(udata);
+    if (udata->is_offload && (res = pw_pal_pool_init(udata)) < 0)
+        goto error;
+    if (udata->isplayback && !udata->is_offload && !udata->is_duplex && !udata->is_loopback &&
+        (res = pw_pal_silence_init(udata, props)) < 0) {
+        pw_log_error("can't set up silence detection: %s", spa_strerror(res));
+        goto error;
+    }
+    if (udata->isplayback && !udata->is_offload && !udata->is_duplex && !udata->is_loopback &&
+        (res = pw_pal_prime_init(udata, props)) < 0) {
+        pw_log_error("can't set up start pre-roll: %s", spa_strerror(res));
+        goto error;
+    }
+    if (!udata->isplayback && !udata->is_loopback && !udata->use_node &&
+        (res = pw_pal_fanout_init(udata, props)) < 0) {
+        pw_log_error("can't set up capture taps: %s", spa_strerror(res));
+        goto error;
+    }
+    if ((res = pw_pal_arena_init(udata)) < 0)
+        goto error;
+    if ((res = pw_pal_ssr_init(udata, props)) < 0) {
+        pw_log_error("can't set up DSP restart recovery: %s", spa_strerror(res));
+        goto error;
+    }
+    if ((res = udata->use_node ? pw_pal_create_node(udata) : pw_pal_create_stream(udata)) < 0)
+        goto error;
+    pw_pal_update_device_latency(udata);
+    if (udata->is_duplex) {
+        pw_pal_duplex_fill_stream_info(udata);
+        if ((res = pw_pal_duplex_create_stream(udata)) < 0)
+            goto error;
+    }
+    if (udata->fanout.enabled && (res = pw_pal_fanout_create_streams(udata)) < 0)
         goto error;
     pw_impl_module_add_listener(module, &udata->module_listener, &pw_pal_events_module, udata);
+    if (udata->is_loopback && udata->loopback.enabled)
+        pw_pal_stream_start(udata);
+    if (pw_pal_stats_register(udata))
+        pw_log_error("failed to register stats timer for %s", pw_properties_get(props, PW_KEY_NODE_NAME));
     if (udata->jack_name && udata->jack_name[0] != '\0') {
         if(jack_register(udata))
             pw_log_error("failed to register jack event for %s", udata->jack_name);
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+# SPDX-License-Identifier: BSD-3-Clause
+
+"""Compare the per-cycle cost of pal.node.mode = stream and spa.
+
+Loads the same PAL sink twice, once as a pw_stream client and once as a
+native SPA node, plays a generated tone into each for --seconds and prints
+the pal.stats.cycle.* counters both published, read with pw-dump:
+
+    pw-pal-bench.py --seconds 30 --quantum 256 \\
+        --args 'media.class = Audio/Sink devices = [ Speaker ]'
+
+The module is loaded into a pw-cli for each run: the stream connects to the
+daemon as its client, the SPA node is exported to it, so both show up in
+pw-dump and play in the daemon's graph. The two runs are sequential, so
+both see the same DSP and the same graph.
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import wave
+
+MODULE = 'libpipewire-module-pal'
+LOADED_RE = re.compile(r'^(\d+)\s*=\s*@module:\d+')
+MODES = ('stream', 'spa')
+KEYS = ('cycles', 'cycle.avg-ns', 'cycle.max-ns', 'cycle.overhead-avg-ns',
+        'cycle.wakeup-avg-ns', 'cycle.wakeup-max-ns')
+
+
+def write_tone(path, seconds, rate):
+    with wave.open(path, 'wb') as w:
+        w.setnchannels(2)
+        w.setsampwidth(2)
+        w.setframerate(rate)
+        frames = bytearray()
+        for i in range(int(seconds * rate)):
+            v = int(8000 * math.sin(2 * math.pi * 440 * i / rate))
+            frames += struct.pack('<hh', v, v)
+        w.writeframes(bytes(frames))
+
+
+def node_stats(name):
+    out = subprocess.run(['pw-dump'], check=True, capture_output=True, text=True).stdout
+    for obj in json.loads(out):
+        props = (obj.get('info') or {}).get('props') or {}
+        if props.get('node.name') == name:
+            return {k: int(props['pal.stats.' + k]) for k in KEYS
+                    if 'pal.stats.' + k in props}
+    return {}
+
+
+def run(mode, args):
+    name = 'pal_bench_' + mode
+    module_args = '{ node.name = %s pal.node.mode = %s pal.stats.interval-ms = 500 %s }' % (
+        name, mode, args.args)
+    cli = subprocess.Popen(['pw-cli'], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, text=True, bufsize=1)
+    cli.stdin.write('load-module %s %s\n' % (MODULE, module_args))
+    cli.stdin.flush()
+    for line in cli.stdout:
+        if LOADED_RE.match(line.strip().lstrip('>').strip()):
+            break
+        if 'error' in line.lower():
+            sys.exit('%s: load failed: %s' % (mode, line.strip()))
+    else:
+        sys.exit('%s: pw-cli exited' % mode)
+
+    env = dict(os.environ, PIPEWIRE_QUANTUM='%d/%d' % (args.quantum, args.rate))
+    subprocess.run(['pw-play', '--target', name, args.tone], check=True, env=env)
+    # let the last interval be published
+    time.sleep(1)
+    stats = node_stats(name)
+    cli.stdin.close()
+    cli.wait()
+    return stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--seconds', type=float, default=10)
+    parser.add_argument('--quantum', type=int, default=256)
+    parser.add_argument('--rate', type=int, default=48000)
+    parser.add_argument('--args', default='media.class = Audio/Sink',
+                        help='extra module arguments, without braces')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        args.tone = os.path.join(tmp, 'tone.wav')
+        write_tone(args.tone, args.seconds, args.rate)
+        results = {mode: run(mode, args) for mode in MODES}
+
+    print('%-28s %14s %14s %10s' % ('pal.stats.', 'stream', 'spa', 'change'))
+    for key in KEYS:
+        a = results['stream'].get(key)
+        b = results['spa'].get(key)
+        if a is None or b is None:
+            print('%-28s %14s %14s' % (key, a if a is not None else '-',
+                                        b if b is not None else '-'))
+            continue
+        change = '%+.1f%%' % (100.0 * (b - a) / a) if a else '-'
+        print('%-28s %14d %14d %10s' % (key, a, b, change))
+
+
+if __name__ == '__main__':
+    main()
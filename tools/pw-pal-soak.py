@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+# Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+# SPDX-License-Identifier: BSD-3-Clause
+
+"""Drive the PAL module through its session life cycle in a loop and check
+that nothing leaks.
+
+The module is loaded into a long-running pw-cli, which owns its streams and
+its PAL sessions, so the fd count, RSS and open sound device fds of that one
+process show what a cycle leaves behind. Every cycle:
+
+  - loads the module,
+  - connects a pw-play (sinks) or pw-record (sources) client to the node,
+    which opens and starts a PAL session,
+  - suspends and resumes the node with pactl, which stops and restarts it,
+  - plugs and unplugs a virtual headset jack, which reroutes it,
+  - disconnects the client, which closes the session,
+  - unloads the module.
+
+The jack is a uinput headphone switch named "pw-pal-soak Headset Jack",
+which the module finds through its jack-name; creating it needs write
+access to /dev/uinput. After --warmup cycles the baseline is taken; the run
+fails if any count grew by more than the allowed slack at the end.
+
+    pw-pal-soak.py --cycles 500 \\
+        --args 'media.class = Audio/Sink devices = [ Speaker Headset ]'
+
+Heap checking, by running pw-cli under valgrind, or with a module built with
+-fsanitize=address and the ASan runtime preloaded; either makes pw-cli exit
+non-zero on leaks:
+    pw-pal-soak.py --wrap 'valgrind --leak-check=full --error-exitcode=99'
+    LD_PRELOAD=libasan.so.8 ASAN_OPTIONS=exitcode=99 pw-pal-soak.py
+"""
+
+import argparse
+import fcntl
+import math
+import os
+import re
+import shlex
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import wave
+
+MODULE = 'libpipewire-module-pal'
+LOADED_RE = re.compile(r'^(\d+)\s*=\s*@module:\d+')
+JACK_NAME = 'pw-pal-soak Headset Jack'
+
+# linux/uinput.h and linux/input-event-codes.h
+UI_SET_EVBIT = 0x40045564
+UI_SET_SWBIT = 0x4004556d
+UI_DEV_CREATE = 0x5501
+UI_DEV_DESTROY = 0x5502
+EV_SYN = 0x00
+EV_SW = 0x05
+SW_HEADPHONE_INSERT = 0x02
+
+
+def fd_count(pid):
+    return len(os.listdir('/proc/%d/fd' % pid))
+
+
+def device_fd_count(pid):
+    """fds on sound devices, one or more per open PAL session"""
+    n = 0
+    for fd in os.listdir('/proc/%d/fd' % pid):
+        try:
+            target = os.readlink('/proc/%d/fd/%s' % (pid, fd))
+        except OSError:
+            continue
+        if target.startswith('/dev/snd/') or 'agm' in target or 'msm' in target:
+            n += 1
+    return n
+
+
+def rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+
+def sample(pid):
+    return {'fds': fd_count(pid), 'device fds': device_fd_count(pid), 'rss kB': rss_kb(pid)}
+
+
+class Jack:
+    """A headphone jack switch the module's jack-name matches."""
+
+    def __init__(self):
+        self.fd = os.open('/dev/uinput', os.O_WRONLY | os.O_NONBLOCK)
+        fcntl.ioctl(self.fd, UI_SET_EVBIT, EV_SW)
+        fcntl.ioctl(self.fd, UI_SET_SWBIT, SW_HEADPHONE_INSERT)
+        # struct uinput_user_dev: name, input_id, ff_effects_max, abs arrays
+        dev = struct.pack('80sHHHHI', JACK_NAME.encode(), 0x06, 0, 0, 0, 0)
+        os.write(self.fd, dev + bytes(4 * 64 * 4))
+        fcntl.ioctl(self.fd, UI_DEV_CREATE)
+        # let udev create the event node before the module scans for it
+        time.sleep(0.5)
+
+    def event(self, type_, code, value):
+        os.write(self.fd, struct.pack('llHHi', 0, 0, type_, code, value))
+
+    def plug(self, connected):
+        self.event(EV_SW, SW_HEADPHONE_INSERT, 1 if connected else 0)
+        self.event(EV_SYN, 0, 0)
+
+    def close(self):
+        fcntl.ioctl(self.fd, UI_DEV_DESTROY)
+        os.close(self.fd)
+
+
+class Cli:
+    def __init__(self, wrap):
+        argv = shlex.split(wrap) + ['pw-cli'] if wrap else ['pw-cli']
+        self.proc = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT, text=True, bufsize=1)
+
+    def command(self, line):
+        self.proc.stdin.write(line + '\n')
+        self.proc.stdin.flush()
+
+    def load(self, args):
+        self.command('load-module %s %s' % (MODULE, args))
+        for line in self.proc.stdout:
+            m = LOADED_RE.match(line.strip().lstrip('>').strip())
+            if m:
+                return int(m.group(1))
+            if 'error' in line.lower():
+                sys.exit('load failed: ' + line.strip())
+        sys.exit('pw-cli exited')
+
+    def unload(self, module_id):
+        self.command('unload-module %d' % module_id)
+
+    def close(self):
+        self.proc.stdin.close()
+        return self.proc.wait()
+
+
+def write_tone(path, seconds, rate=48000):
+    with wave.open(path, 'wb') as w:
+        w.setnchannels(2)
+        w.setsampwidth(2)
+        w.setframerate(rate)
+        frames = bytearray()
+        for i in range(int(seconds * rate)):
+            v = int(8000 * math.sin(2 * math.pi * 440 * i / rate))
+            frames += struct.pack('<hh', v, v)
+        w.writeframes(bytes(frames))
+
+
+def session(args, jack, tone, record):
+    """One client connection with a suspend/resume and a jack cycle."""
+    if args.sink:
+        argv = ['pw-play', '--target', args.name, tone]
+        suspend = 'suspend-sink'
+    else:
+        argv = ['pw-record', '--target', args.name, record]
+        suspend = 'suspend-source'
+    client = subprocess.Popen(argv, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    step = args.phase_ms / 1000.0
+
+    time.sleep(step)
+    subprocess.run(['pactl', suspend, args.name, '1'], check=True)
+    time.sleep(step)
+    subprocess.run(['pactl', suspend, args.name, '0'], check=True)
+    time.sleep(step)
+    if jack:
+        jack.plug(True)
+        time.sleep(step)
+        jack.plug(False)
+        time.sleep(step)
+
+    client.send_signal(signal.SIGINT)
+    try:
+        client.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        client.kill()
+        client.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--cycles', type=int, default=200)
+    parser.add_argument('--warmup', type=int, default=10,
+                        help='cycles before the baseline is taken')
+    parser.add_argument('--name', default='pal_soak', help='node.name of the module')
+    parser.add_argument('--args', default='media.class = Audio/Sink',
+                        help='extra module arguments, without braces')
+    parser.add_argument('--phase-ms', type=int, default=300,
+                        help='time spent in each phase of a session')
+    parser.add_argument('--no-jack', action='store_true',
+                        help='do not create the uinput jack')
+    parser.add_argument('--wrap', default='',
+                        help='command to run pw-cli under, e.g. valgrind')
+    parser.add_argument('--fd-slack', type=int, default=0)
+    parser.add_argument('--rss-slack-kb', type=int, default=512)
+    args = parser.parse_args()
+    args.sink = 'Source' not in args.args
+
+    jack_arg = '' if args.no_jack else 'jack-name = "%s"' % JACK_NAME
+    module_args = '{ node.name = %s %s %s }' % (args.name, jack_arg, args.args)
+    jack = None if args.no_jack else Jack()
+    cli = Cli(args.wrap)
+    pid = cli.proc.pid
+    base = None
+
+    with tempfile.TemporaryDirectory() as tmp:
+        tone = os.path.join(tmp, 'tone.wav')
+        record = os.path.join(tmp, 'record.wav')
+        # long enough to outlast every phase, the client is stopped early
+        write_tone(tone, args.phase_ms * 6 / 1000.0)
+
+        # samples are taken with the module loaded and its session closed
+        # again, after pw-cli answered the load
+        for cycle in range(args.cycles):
+            module_id = cli.load(module_args)
+            session(args, jack, tone, record)
+            if cycle + 1 == args.warmup:
+                base = sample(pid)
+            if (cycle + 1) % 50 == 0:
+                print('%d cycles, %s' % (cycle + 1, sample(pid)))
+            cli.unload(module_id)
+
+        module_id = cli.load(module_args)
+        end = sample(pid)
+        cli.unload(module_id)
+    rc = cli.close()
+    if jack:
+        jack.close()
+
+    if base is None:
+        sys.exit('--cycles must be larger than --warmup')
+    print('baseline %s\nend      %s\npw-cli exit %d' % (base, end, rc))
+    failed = False
+    if end['fds'] - base['fds'] > args.fd_slack:
+        print('fd leak: %d fds' % (end['fds'] - base['fds']))
+        failed = True
+    if end['device fds'] > base['device fds']:
+        print('PAL session leak: %d device fds' % (end['device fds'] - base['device fds']))
+        failed = True
+    if end['rss kB'] - base['rss kB'] > args.rss_slack_kb:
+        print('memory growth: %d kB' % (end['rss kB'] - base['rss kB']))
+        failed = True
+    if rc:
+        print('pw-cli (or --wrap) reported errors')
+        failed = True
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+# Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+# SPDX-License-Identifier: BSD-3-Clause
+
+"""Turn a capture of the pw_pal USDT probes into per-node latency timelines.
+
+The module must be built with sys/sdt.h available (see --disable-tracing).
+
+perf:
+    LIB=/usr/lib/pipewire-0.3/libpipewire-module-pal.so
+    perf buildid-cache --add $LIB
+    perf probe -x $LIB -a 'sdt_pw_pal:*'
+    perf record -e 'sdt_pw_pal:*' -aR -- sleep 10
+    perf script | pw-pal-trace.py
+
+trace-cmd, after the same 'perf probe' step:
+    trace-cmd record -e sdt_pw_pal -- sleep 10
+    trace-cmd report | pw-pal-trace.py
+
+Every probe carries the graph node id as first argument:
+    process_entry  node cycle          process_exit  node bytes rc
+    write_entry    node bytes          write_exit    node bytes rc
+    read_entry     node bytes          read_exit     node bytes rc
+    state          node old new        jack          node code value rc
+    open           node stream-type rc start         node rc
+    close          node rc
+
+"overhead" is the time spent in the process callback outside of PAL I/O,
+which is what pal.node.mode = "spa" is meant to shrink.
+"""
+
+import argparse
+import re
+import sys
+from collections import defaultdict
+
+EVENT_RE = re.compile(r'\s(\d+\.\d+):\s+(?:sdt_pw_pal:)?(\w+):.*?((?:\barg\d+=\S+\s*)*)$')
+ARG_RE = re.compile(r'arg(\d+)=(\S+)')
+
+STATES = {'-1': 'error', '0': 'unconnected', '1': 'connecting', '2': 'paused', '3': 'streaming'}
+PAIRS = {'process_exit': 'process_entry', 'write_exit': 'write_entry', 'read_exit': 'read_entry'}
+MARKERS = ('state', 'open', 'start', 'close', 'jack')
+
+
+def parse_int(value):
+    try:
+        return int(value, 0)
+    except ValueError:
+        return 0
+
+
+class Series:
+    def __init__(self):
+        self.values = []
+        self.errors = 0
+
+    def add(self, value_us):
+        self.values.append(value_us)
+
+    def summary(self):
+        if not self.values:
+            return 'n/a'
+        v = sorted(self.values)
+        p99 = v[min(len(v) - 1, int(len(v) * 0.99))]
+        return 'n=%d avg=%.1f p99=%.1f max=%.1f us%s' % (
+            len(v), sum(v) / len(v), p99, v[-1],
+            ' errors=%d' % self.errors if self.errors else '')
+
+
+class Node:
+    def __init__(self):
+        self.open = {}
+        self.last_entry = None
+        self.io_us = 0.0
+        self.series = defaultdict(Series)
+        self.timeline = []
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('file', nargs='?', type=argparse.FileType('r'), default=sys.stdin,
+                        help='perf script or trace-cmd report output (default: stdin)')
+    parser.add_argument('--timeline', action='store_true',
+                        help='print control events and slow cycles per node in time order')
+    parser.add_argument('--slow-us', type=float, default=0.0,
+                        help='with --timeline, show PAL calls slower than this')
+    args = parser.parse_args()
+
+    nodes = defaultdict(Node)
+    t0 = None
+
+    for line in args.file:
+        m = EVENT_RE.search(line)
+        if not m:
+            continue
+        ts = float(m.group(1))
+        name = m.group(2)
+        argv = {int(k): v for k, v in ARG_RE.findall(m.group(3))}
+        if not argv:
+            continue
+        if t0 is None:
+            t0 = ts
+        node = nodes[parse_int(argv[1])]
+
+        if name == 'process_entry':
+            if node.last_entry is not None:
+                node.series['period'].add((ts - node.last_entry) * 1e6)
+            node.last_entry = ts
+            node.io_us = 0.0
+
+        if name in PAIRS.values():
+            node.open[name] = ts
+        elif name in PAIRS:
+            start = node.open.pop(PAIRS[name], None)
+            if start is None:
+                continue
+            key = name[:-len('_exit')]
+            duration = (ts - start) * 1e6
+            series = node.series[key]
+            series.add(duration)
+            if key == 'process':
+                node.series['overhead'].add(max(duration - node.io_us, 0.0))
+            else:
+                node.io_us += duration
+            rc = parse_int(argv.get(3, '0'))
+            if rc < 0:
+                series.errors += 1
+            if args.slow_us and key != 'process' and duration >= args.slow_us:
+                node.timeline.append((ts - t0, '%s %d bytes took %.1f us rc=%d' %
+                                      (key, parse_int(argv.get(2, '0')), duration, rc)))
+        elif name in MARKERS:
+            if name == 'state':
+                text = 'state %s -> %s' % (STATES.get(argv.get(2), argv.get(2)),
+                                           STATES.get(argv.get(3), argv.get(3)))
+            else:
+                text = name + ' ' + ' '.join(argv[k] for k in sorted(argv) if k > 1)
+            node.timeline.append((ts - t0, text))
+
+    if not nodes:
+        sys.exit('no pw_pal probe events found')
+
+    for node_id in sorted(nodes):
+        node = nodes[node_id]
+        print('node %d' % node_id)
+        for key in ('period', 'process', 'overhead', 'write', 'read'):
+            if key in node.series:
+                print('  %-8s %s' % (key, node.series[key].summary()))
+        if args.timeline:
+            for ts, text in node.timeline:
+                print('  %12.6f  %s' % (ts, text))
+
+
+if __name__ == '__main__':
+    main()